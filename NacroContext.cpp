@@ -0,0 +1,595 @@
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/raw_ostream.h"
+#include "clang/Basic/FileManager.h"
+#include "clang/Lex/MacroArgs.h"
+#include "clang/Lex/MacroInfo.h"
+#include "clang/Lex/PPCallbacks.h"
+#include "NacroContext.h"
+#include "NacroExpanders.h"
+#include "NacroParsers.h"
+#include "NacroVerifier.h"
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <tuple>
+
+using namespace clang;
+
+namespace clang {
+/// The only PPCallbacks nacro installs on a Preprocessor.
+/// Instead of having one PPCallbacks per rule, which makes every
+/// macro expansion walk through all of them, it dispatches the
+/// expansion to its rule with a single lookup.
+struct NacroPPCallbacks : public PPCallbacks {
+  explicit NacroPPCallbacks(Preprocessor& PP)
+    : Ctx(new NacroContext(PP)) {}
+
+  void MacroExpands(const Token& MacroNameToken,
+                    const MacroDefinition& MD,
+                    SourceRange Range,
+                    const MacroArgs* ConstArgs) override {
+    auto* MacroII = MacroNameToken.getIdentifierInfo();
+    assert(MacroII);
+    if(!Ctx->MarkRuleInvoked(MacroII, MD.getMacroInfo())) return;
+    Ctx->AddInvocation(MacroNameToken.getLocation());
+
+    if(Ctx->isLazyRule(MacroII, MD.getMacroInfo())) {
+      llvm::TimeTraceScope TimeScope("NacroMaterializeRule",
+                                     MacroII->getName());
+      Ctx->MaterializeLazyRule(MacroNameToken, Range, ConstArgs);
+      return;
+    }
+
+    auto* Rule = Ctx->getLoopRule(MacroII, MD.getMacroInfo());
+    if(Ctx->getOptions().TraceFile.empty()) {
+      if(Rule)
+        ExpandLoop(Rule, MacroNameToken, Range, ConstArgs);
+      return;
+    }
+
+    // Lazy rules are traced when the invocation is re-injected
+    auto Begin = std::chrono::steady_clock::now();
+    auto PrevExpandedTokens = Ctx->NumExpandedTokens;
+    if(Rule)
+      ExpandLoop(Rule, MacroNameToken, Range, ConstArgs);
+    std::chrono::duration<double, std::micro> Elapsed
+      = std::chrono::steady_clock::now() - Begin;
+    llvm::Optional<size_t> LoopTokens;
+    if(Rule)
+      LoopTokens = Ctx->NumExpandedTokens - PrevExpandedTokens;
+    Ctx->TraceInvocation(MacroNameToken, MD.getMacroInfo(), ConstArgs,
+                         LoopTokens, Elapsed.count());
+  }
+
+  void EndOfMainFile() override {
+    Ctx->FlushTrace();
+  }
+
+  void ExpandLoop(NacroRule* Rule, const Token& MacroNameToken,
+                  SourceRange Range, const MacroArgs* ConstArgs) {
+    llvm::TimeTraceScope TimeScope("NacroExpandLoop", Rule->getNameStr());
+    // FIXME: Is this safe?
+    auto* Args = const_cast<MacroArgs*>(ConstArgs);
+    NacroLoopExpander(Rule, *Ctx)
+      .ExpandInvocation(MacroNameToken, Range, Args);
+  }
+
+  std::unique_ptr<NacroContext> Ctx;
+};
+} // end namespace clang
+
+/// Contexts of all the live Preprocessors in this process. Clang 10
+/// doesn't let us find our own PPCallbacks or pragma handler from a
+/// Preprocessor, so we key on its address instead. A Preprocessor
+/// might be torn down on another thread than the one running it
+/// (e.g. libTooling workers handing ASTUnits back), so this is a
+/// single map guarded by NacroContextsLock rather than a per-thread
+/// one: an entry is always erased before its address can be reused.
+/// It's only consulted by entry points like the pragma handler, which
+/// pass the context down to parsers and expanders.
+static llvm::DenseMap<const Preprocessor*, NacroContext*> NacroContexts;
+static std::mutex NacroContextsLock;
+
+/// Clang doesn't run plugin actions when it only preprocesses
+/// (e.g. `-E`), in which case plugin arguments never reach us.
+/// Options given by `-mllvm` are available in every mode.
+static llvm::cl::list<std::string>
+  NacroOptionArgs("nacro-option", llvm::cl::ZeroOrMore,
+                  llvm::cl::value_desc("option"),
+                  llvm::cl::desc("Option of the nacro plugin, in the same "
+                                 "form as its plugin arguments"));
+
+bool NacroOptions::Parse(StringRef Arg, DiagnosticsEngine& Diag) {
+  // Options in the form of `<name>=<value>`
+  StringRef Name, Value;
+  std::tie(Name, Value) = Arg.split('=');
+  unsigned* IntOption = nullptr;
+  if(Name == "max-expansion-tokens")
+    IntOption = &MaxExpansionTokens;
+  else if(Name == "max-tu-expansion-tokens")
+    IntOption = &MaxTUExpansionTokens;
+  else if(Name == "verifier-threads")
+    IntOption = &VerifierThreads;
+
+  if(Arg == "raw-lexing") {
+    RawLexing = true;
+  } else if(Arg == "lazy-rules") {
+    LazyRules = true;
+  } else if(Arg == "hygiene") {
+    Hygiene = true;
+  } else if(Name == "trace-file" && !Value.empty()) {
+    TraceFile = Value.str();
+  } else if(IntOption) {
+    if(Value.getAsInteger(10, *IntOption)) {
+      auto DiagID = Diag.getCustomDiagID(DiagnosticsEngine::Error,
+                                         "invalid value '%0' for "
+                                         "nacro option '%1'");
+      Diag.Report(DiagID) << Value << Name;
+      return false;
+    }
+  } else {
+    auto DiagID = Diag.getCustomDiagID(DiagnosticsEngine::Error,
+                                       "unknown nacro option '%0'");
+    Diag.Report(DiagID) << Arg;
+    return false;
+  }
+  return true;
+}
+
+NacroContext::NacroContext(Preprocessor& PP)
+  : PP(PP),
+    RuleDepot(new NacroRuleDepot()),
+    NumMaterializedRules(0),
+    NumDuplicatedRules(0), NumConflictingRules(0),
+    NumRetiredRules(0),
+    NumCachedTokens(0),
+    NumExpansionCacheHits(0), NumExpansionCacheMisses(0),
+    NumStringifiedHits(0), NumScratchBytesSaved(0),
+    NumExpandedTokens(0), NextExpansionID(0) {
+  for(const auto& Arg : NacroOptionArgs)
+    Options.Parse(Arg, PP.getDiagnostics());
+}
+
+NacroContext::~NacroContext() {
+  std::lock_guard<std::mutex> Guard(NacroContextsLock);
+  NacroContexts.erase(&PP);
+}
+
+NacroRule* NacroContext::CreateRule(IdentifierInfo* NameII) {
+  if(!FreeRules.empty()) {
+    auto* Rule = FreeRules.pop_back_val();
+    // Reset all the states
+    Rule->~NacroRule();
+    return new (Rule) NacroRule(NameII);
+  }
+  return new (RuleAllocator.Allocate()) NacroRule(NameII);
+}
+
+void NacroContext::DestroyRule(NacroRule* Rule) {
+  // Every allocated rule will be destructed by RuleAllocator,
+  // so just recycle it
+  FreeRules.push_back(Rule);
+}
+
+NacroContext& NacroContext::Get(Preprocessor& PP) {
+  std::lock_guard<std::mutex> Guard(NacroContextsLock);
+  auto It = NacroContexts.find(&PP);
+  if(It != NacroContexts.end())
+    return *It->second;
+
+  auto Callbacks = std::make_unique<NacroPPCallbacks>(PP);
+  auto* Ctx = Callbacks->Ctx.get();
+  NacroContexts.insert({&PP, Ctx});
+  // Preprocessor takes the ownership
+  PP.addPPCallbacks(std::move(Callbacks));
+  return *Ctx;
+}
+
+void NacroContext::AddLoopRule(NacroRule* Rule,
+                               const MacroInfo* Placeholder) {
+  assert(Rule->getName() && "Loop rule without name?");
+  LoopRules[Rule->getName()] = LoopRuleEntry{Rule, Placeholder};
+}
+
+bool NacroContext::isDuplicatedRule(const Token& NameTok, size_t Fingerprint,
+                                    SourceLocation BeginLoc) {
+  auto* II = NameTok.getIdentifierInfo();
+  auto It = DefinedRules.find(II);
+  // Not defined, or it has been overridden by other macros
+  if(It == DefinedRules.end() || PP.getMacroInfo(II) != It->second.MI)
+    return false;
+
+  if(It->second.Fingerprint == Fingerprint) {
+    ++NumDuplicatedRules;
+    return true;
+  }
+
+  ++NumConflictingRules;
+  auto& Diag = PP.getDiagnostics();
+  auto WarnID = Diag.getCustomDiagID(DiagnosticsEngine::Warning,
+                                     "nacro rule '%0' is redefined "
+                                     "with a different body");
+  auto NoteID = Diag.getCustomDiagID(DiagnosticsEngine::Note,
+                                     "previous definition is here");
+  Diag.Report(BeginLoc, WarnID) << II->getName();
+  Diag.Report(It->second.BeginLoc, NoteID);
+  return false;
+}
+
+void NacroContext::AddDefinedRule(const IdentifierInfo* II,
+                                  size_t Fingerprint,
+                                  SourceLocation BeginLoc,
+                                  NacroRule* Rule) {
+  auto* MI = PP.getMacroInfo(II);
+  DefinedRules[II] = DefinedRuleEntry{Fingerprint, MI, BeginLoc,
+                                      Rule, /*Invoked=*/false};
+}
+
+void NacroContext::RetireRule(const IdentifierInfo* II) {
+  auto It = DefinedRules.find(II);
+  if(It == DefinedRules.end()) return;
+  auto Entry = It->second;
+  DefinedRules.erase(It);
+  LazyRules.erase(II);
+  LoopRules.erase(II);
+  ++NumRetiredRules;
+
+  auto* Rule = Entry.Rule;
+  if(!Rule) return;
+  for(auto CI = ExpansionCache.begin(), CE = ExpansionCache.end();
+      CI != CE;) {
+    auto Cur = CI++;
+    if(Cur->first.first != Rule) continue;
+    NumCachedTokens -= Cur->second.Tokens.size();
+    ExpansionCache.erase(Cur);
+  }
+
+  // Tokens expanded from this rule still refer to it
+  if(Entry.Invoked) return;
+  auto SI = SavedRules.find(II);
+  if(SI != SavedRules.end() &&
+     llvm::any_of(SI->second, [Rule](const SavedRule& SR) {
+                    return SR.Defined && SR.Defined->Rule == Rule;
+                  }))
+    return;
+  NacroVerifier(*this).RemoveNacroRule(Rule);
+  DestroyRule(Rule);
+}
+
+bool NacroContext::UndefRule(const Token& NameTok) {
+  auto* II = NameTok.getIdentifierInfo();
+  auto It = DefinedRules.find(II);
+  if(It == DefinedRules.end() || PP.getMacroInfo(II) != It->second.MI)
+    return false;
+
+  RetireRule(II);
+  PP.appendMacroDirective(II,
+                          PP.AllocateUndefMacroDirective(NameTok.getLocation()));
+  return true;
+}
+
+void NacroContext::PushRule(const Token& NameTok) {
+  auto* II = NameTok.getIdentifierInfo();
+  SavedRule SR{PP.getMacroInfo(II), llvm::None, llvm::None, llvm::None};
+  auto DI = DefinedRules.find(II);
+  if(DI != DefinedRules.end() && DI->second.MI == SR.MI) {
+    SR.Defined = DI->second;
+    auto LI = LoopRules.find(II);
+    if(LI != LoopRules.end()) SR.Loop = LI->second;
+    auto ZI = LazyRules.find(II);
+    if(ZI != LazyRules.end()) SR.Lazy = ZI->second;
+  }
+  SavedRules[II].push_back(SR);
+}
+
+bool NacroContext::PopRule(const Token& NameTok) {
+  auto* II = NameTok.getIdentifierInfo();
+  auto SI = SavedRules.find(II);
+  if(SI == SavedRules.end()) return false;
+  auto SR = SI->second.pop_back_val();
+  if(SI->second.empty()) SavedRules.erase(SI);
+
+  auto* CurMI = PP.getMacroInfo(II);
+  // Nothing has changed since the push
+  if(CurMI == SR.MI) return true;
+
+  auto DI = DefinedRules.find(II);
+  if(DI != DefinedRules.end() && DI->second.MI == CurMI)
+    RetireRule(II);
+
+  auto Loc = NameTok.getLocation();
+  if(SR.MI)
+    PP.appendDefMacroDirective(II, SR.MI, Loc);
+  else if(CurMI)
+    PP.appendMacroDirective(II, PP.AllocateUndefMacroDirective(Loc));
+
+  if(SR.Defined) {
+    DefinedRules[II] = *SR.Defined;
+    if(SR.Loop) LoopRules[II] = *SR.Loop;
+    if(SR.Lazy) LazyRules[II] = *SR.Lazy;
+  }
+  return true;
+}
+
+void NacroContext::AddLazyRule(const Token& NameTok, SourceLocation BeginLoc,
+                               size_t Fingerprint) {
+  auto* II = NameTok.getIdentifierInfo();
+  assert(II && "Lazy rule without name?");
+  // Accept any argument, the real rule will check them
+  auto* MI = PP.AllocateMacroInfo(NameTok.getLocation());
+  MI->setIsFunctionLike();
+  MI->setIsC99Varargs();
+  IdentifierInfo* VAArgsII = PP.getIdentifierInfo("__VA_ARGS__");
+  MI->setParameterList(VAArgsII, PP.getPreprocessorAllocator());
+  PP.appendDefMacroDirective(II, MI);
+
+  LazyRules[II] = LazyRuleEntry{NameTok, BeginLoc, MI};
+  AddDefinedRule(II, Fingerprint, BeginLoc, /*Rule=*/nullptr);
+}
+
+void NacroContext::MaterializeLazyRule(const Token& MacroNameToken,
+                                       SourceRange Range,
+                                       const MacroArgs* Args) {
+  auto* II = MacroNameToken.getIdentifierInfo();
+  auto It = LazyRules.find(II);
+  assert(It != LazyRules.end());
+  auto Entry = It->second;
+  LazyRules.erase(It);
+
+  NacroRuleParser Parser(*this, Entry.NameTok);
+  auto* Rule = Parser.getNacroRule();
+  // Retire the placeholder as well, otherwise the following
+  // invocations are silently expanded to nothing
+  auto Discard = [&] {
+    DestroyRule(Rule);
+    RetireRule(II);
+    PP.appendMacroDirective(II,
+                            PP.AllocateUndefMacroDirective(Entry.BeginLoc));
+  };
+  if(!Parser.UseRawLexer(Entry.BeginLoc) || !Parser.Parse()) {
+    Discard();
+    return;
+  }
+
+  NacroRuleExpander Expander(Rule, *this);
+  if(auto E = Expander.Expand()) {
+    auto& Diag = PP.getDiagnostics();
+    auto DiagID = Diag.getCustomDiagID(DiagnosticsEngine::Error,
+                                       "failed to expand nacro rule "
+                                       "'%0': %1");
+    Diag.Report(Entry.BeginLoc, DiagID)
+      << II->getName() << llvm::toString(std::move(E));
+    Discard();
+    return;
+  }
+
+  NacroVerifier(*this).AddNacroRule(Rule);
+  ++NumMaterializedRules;
+  // The placeholder is replaced by the real macro
+  auto& Defined = DefinedRules[II];
+  Defined.MI = PP.getMacroInfo(II);
+  Defined.Rule = Rule;
+
+  // The (empty) placeholder is going to be expanded. Put the
+  // invocation back so it will be expanded by the real rule next.
+  // Since the placeholder only has a single variadic parameter,
+  // the argument contains all the commas.
+  assert(Args && Args->getNumMacroArguments() == 1);
+  const auto* ArgToks = Args->getUnexpArgument(0);
+  auto NumArgToks = MacroArgs::getArgLength(ArgToks);
+  auto NumTokens = NumArgToks + 3;
+  auto TokenStream = std::make_unique<Token[]>(NumTokens);
+  TokenStream[0] = MacroNameToken;
+  auto& LParen = TokenStream[1];
+  LParen.startToken();
+  LParen.setKind(tok::l_paren);
+  LParen.setLength(1);
+  LParen.setLocation(MacroNameToken.getEndLoc());
+  std::copy(ArgToks, ArgToks + NumArgToks, &TokenStream[2]);
+  auto& RParen = TokenStream[NumTokens - 1];
+  RParen.startToken();
+  RParen.setKind(tok::r_paren);
+  RParen.setLength(1);
+  RParen.setLocation(Range.getEnd());
+  PP.EnterTokenStream(std::move(TokenStream), NumTokens,
+                      /*DisableMacroExpansion=*/false,
+                      /*IsReinject=*/false);
+}
+
+const NacroContext::CachedExpansion*
+NacroContext::lookupExpansion(const NacroRule* Rule, StringRef ArgsKey) {
+  auto It = ExpansionCache.find({Rule, size_t(llvm::hash_value(ArgsKey))});
+  if(It == ExpansionCache.end() || It->second.ArgsKey != ArgsKey) {
+    ++NumExpansionCacheMisses;
+    return nullptr;
+  }
+  ++NumExpansionCacheHits;
+  return &It->second;
+}
+
+void NacroContext::cacheExpansion(const NacroRule* Rule, StringRef ArgsKey,
+                                  ArrayRef<Token> Tokens,
+                                  ArrayRef<std::pair<unsigned, unsigned>>
+                                    ParamSlots,
+                                  ArrayRef<std::pair<unsigned, unsigned>>
+                                    StrSlots) {
+  if(NumCachedTokens + Tokens.size() > MaxCachedTokens) return;
+
+  auto& Entry = ExpansionCache[{Rule, size_t(llvm::hash_value(ArgsKey))}];
+  NumCachedTokens -= Entry.Tokens.size();
+  NumCachedTokens += Tokens.size();
+  Entry.ArgsKey = ArgsKey.str();
+  Entry.Tokens.assign(Tokens.begin(), Tokens.end());
+  Entry.ParamSlots.assign(ParamSlots.begin(), ParamSlots.end());
+  Entry.StrSlots.assign(StrSlots.begin(), StrSlots.end());
+}
+
+const Token* NacroContext::lookupStringified(StringRef Key) {
+  auto It = StringifiedTokens.find(Key);
+  if(It == StringifiedTokens.end()) return nullptr;
+
+  ++NumStringifiedHits;
+  // The scratch buffer prefixes every token with a newline
+  // and terminates it with a null character
+  NumScratchBytesSaved += It->second.getLength() + 2;
+  return &It->second;
+}
+
+void NacroContext::AddInvocation(SourceLocation Loc) {
+  auto& SM = PP.getSourceManager();
+  FileID FID;
+  unsigned Offset;
+  std::tie(FID, Offset) = SM.getDecomposedExpansionLoc(Loc);
+  if(FID.isInvalid()) return;
+  auto& Offsets = InvocationOffsets[FID];
+  // Invocations are mostly visited in order, except those
+  // within arguments of other macros
+  if(Offsets.empty() || Offsets.back() < Offset) {
+    Offsets.push_back(Offset);
+    return;
+  }
+  auto It = llvm::lower_bound(Offsets, Offset);
+  // Re-injected lazy rule invocations come here twice
+  if(*It != Offset)
+    Offsets.insert(It, Offset);
+}
+
+bool NacroContext::hasInvocationIn(SourceRange SR) const {
+  if(SR.isInvalid()) return false;
+  auto& SM = PP.getSourceManager();
+  auto Begin = SM.getDecomposedExpansionLoc(SR.getBegin());
+  auto End = SM.getDecomposedLoc(
+               SM.getExpansionRange(SR.getEnd()).getEnd());
+  if(Begin.first != End.first) return true;
+
+  auto It = InvocationOffsets.find(Begin.first);
+  if(It == InvocationOffsets.end()) return false;
+  auto OI = llvm::lower_bound(It->second, Begin.second);
+  return OI != It->second.end() && *OI <= End.second;
+}
+
+void NacroContext::TraceInvocation(const Token& MacroNameToken,
+                                   const MacroInfo* MI,
+                                   const MacroArgs* Args,
+                                   llvm::Optional<size_t> LoopTokens,
+                                   double Microseconds) {
+  // Lengths of the un-expanded actual arguments
+  unsigned NumParams = MI->getNumParams();
+  SmallVector<unsigned, 4> ArgLengths;
+  size_t NumInputTokens = 0;
+  for(unsigned I = 0; Args && I < NumParams; ++I) {
+    ArgLengths.push_back(
+      MacroArgs::getArgLength(Args->getUnexpArgument(I)));
+    NumInputTokens += ArgLengths.back();
+  }
+
+  // Elements are separated by top-level commas
+  unsigned NumVAElements = 0;
+  if(MI->isVariadic() && !ArgLengths.empty() && ArgLengths.back()) {
+    NumVAElements = 1;
+    unsigned ParenDepth = 0;
+    for(const auto* Tok = Args->getUnexpArgument(NumParams - 1);
+        Tok->isNot(tok::eof); ++Tok) {
+      if(Tok->is(tok::l_paren))
+        ++ParenDepth;
+      else if(Tok->is(tok::r_paren) && ParenDepth)
+        --ParenDepth;
+      else if(Tok->is(tok::comma) && !ParenDepth)
+        ++NumVAElements;
+    }
+  }
+
+  size_t NumOutputTokens = 0;
+  if(LoopTokens) {
+    NumOutputTokens = *LoopTokens;
+  } else {
+    // Expanded by Preprocessor as a normal macro. Estimate by
+    // substituting every parameter with its un-expanded argument
+    for(const auto& Tok : MI->tokens()) {
+      int ParamIdx = -1;
+      if(const auto* II = Tok.getIdentifierInfo())
+        ParamIdx = MI->getParameterNum(II);
+      if(ParamIdx >= 0 && unsigned(ParamIdx) < ArgLengths.size())
+        NumOutputTokens += ArgLengths[ParamIdx];
+      else
+        ++NumOutputTokens;
+    }
+  }
+
+  auto& SM = PP.getSourceManager();
+  std::string Loc;
+  auto PLoc = SM.getPresumedLoc(
+                SM.getExpansionLoc(MacroNameToken.getLocation()));
+  if(PLoc.isValid())
+    Loc = (llvm::Twine(PLoc.getFilename()) + ":" +
+           llvm::Twine(PLoc.getLine()) + ":" +
+           llvm::Twine(PLoc.getColumn())).str();
+  StringRef TU;
+  if(const auto* FE = SM.getFileEntryForID(SM.getMainFileID()))
+    TU = FE->getName();
+
+  llvm::raw_string_ostream OS(TraceBuffer);
+  {
+    llvm::json::OStream J(OS);
+    J.object([&] {
+      J.attribute("tu", TU);
+      J.attribute("rule", MacroNameToken.getIdentifierInfo()->getName());
+      J.attribute("loc", Loc);
+      J.attribute("loop", LoopTokens.hasValue());
+      J.attribute("va_elements", int64_t(NumVAElements));
+      J.attribute("input_tokens", int64_t(NumInputTokens));
+      J.attribute("output_tokens", int64_t(NumOutputTokens));
+      J.attribute("time_us", Microseconds);
+    });
+  }
+  OS << "\n";
+}
+
+void NacroContext::FlushTrace() {
+  if(TraceBuffer.empty()) return;
+  std::error_code EC;
+  llvm::raw_fd_ostream OS(Options.TraceFile, EC, llvm::sys::fs::OF_Append);
+  if(EC) {
+    auto& Diag = PP.getDiagnostics();
+    auto DiagID = Diag.getCustomDiagID(DiagnosticsEngine::Warning,
+                                       "unable to open nacro trace "
+                                       "file '%0': %1");
+    Diag.Report(DiagID) << Options.TraceFile << EC.message();
+  } else {
+    // Write all records at once, such that compilations
+    // in the same build can share a single file
+    OS.SetUnbuffered();
+    OS << TraceBuffer;
+  }
+  TraceBuffer.clear();
+}
+
+void NacroContext::PrintStats(llvm::raw_ostream& OS) const {
+  OS << "\n*** Nacro Stats:\n";
+  OS << LoopRules.size() << " looped rules.\n";
+  OS << "Lazy rules: "
+     << NumMaterializedRules << " materialized, "
+     << LazyRules.size() << " never invoked.\n";
+  OS << "Rule redefinitions: "
+     << NumDuplicatedRules << " duplicated, "
+     << NumConflictingRules << " conflicting, "
+     << NumRetiredRules << " retired.\n";
+  OS << NumExpandedTokens << " tokens expanded from looped rules.\n";
+  OS << "Loop expansion cache: "
+     << NumExpansionCacheHits << " hits, "
+     << NumExpansionCacheMisses << " misses, "
+     << ExpansionCache.size() << " entries, "
+     << NumCachedTokens << " tokens cached.\n";
+  OS << "Stringification: "
+     << StringifiedTokens.size() << " unique literals, "
+     << NumStringifiedHits << " reused, "
+     << NumScratchBytesSaved << " scratch buffer bytes saved.\n";
+}
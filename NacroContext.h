@@ -0,0 +1,350 @@
+#ifndef NACRO_NACRO_CONTEXT_H
+#define NACRO_NACRO_CONTEXT_H
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/raw_ostream.h"
+#include "clang/Lex/Preprocessor.h"
+#include "NacroRule.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace clang {
+// Forward Declarations
+class IdentifierInfo;
+struct NacroRuleDepot;
+
+/// Options given by plugin arguments
+/// (i.e. `-plugin-arg-nacro-verifier <option>`) or
+/// `-mllvm -nacro-option=<option>`.
+struct NacroOptions {
+  /// Capture rule definitions with a raw lexer rather than
+  /// the Preprocessor. So no macro is expanded within them.
+  bool RawLexing = false;
+
+  /// Only record the name and location of a rule when it's defined.
+  /// Parse and expand it when it's invoked for the first time.
+  /// Rules are read by raw lexers in this mode.
+  bool LazyRules = false;
+
+  /// Maximum number of tokens a single invocation of looped
+  /// rules can produce. Zero for no limit.
+  unsigned MaxExpansionTokens = 0;
+
+  /// Maximum number of tokens all invocations of looped
+  /// rules can produce in a translation unit. Zero for no limit.
+  unsigned MaxTUExpansionTokens = 0;
+
+  /// Rename identifiers declared within rules on every expansion,
+  /// such that they never capture anything from the invocation site.
+  /// The declaration leak verifier is skipped in this mode.
+  bool Hygiene = false;
+
+  /// Number of threads the declaration leak verifier runs on.
+  /// Zero or one to run on the current thread.
+  unsigned VerifierThreads = 0;
+
+  /// Append a JSON record for every rule invocation to this
+  /// file (JSON lines). Empty to disable.
+  std::string TraceFile;
+
+  /// Apply a single option in the form of `<name>` or `<name>=<value>`.
+  /// Report to \p Diag and return false if it's invalid.
+  bool Parse(llvm::StringRef Arg, DiagnosticsEngine& Diag);
+};
+
+/// Nacro states shared by all the rules within a single
+/// Preprocessor (i.e. a translation unit).
+/// It's owned by the (only) PPCallbacks we install on the Preprocessor,
+/// so its lifetime is identical to the latter.
+class NacroContext {
+  Preprocessor& PP;
+
+  NacroOptions Options;
+
+  /// All the rules in this translation unit. They're
+  /// released altogether with this context.
+  llvm::SpecificBumpPtrAllocator<NacroRule> RuleAllocator;
+  /// Rules released by DestroyRule, which can be reused
+  llvm::SmallVector<NacroRule*, 4> FreeRules;
+
+  /// Source ranges of rules for the declaration leak verifier
+  std::unique_ptr<NacroRuleDepot> RuleDepot;
+
+  struct LoopRuleEntry {
+    NacroRule* Rule;
+    /// The placeholder macro of this rule. In case the
+    /// name is redefined by a normal macro later.
+    const MacroInfo* Placeholder;
+  };
+
+  /// Rules that are expanded by ourself rather than
+  /// the Preprocessor (e.g. rules with loops), indexed by
+  /// their names. So that dispatching a macro expansion
+  /// costs O(1) regardless of the number of rules.
+  llvm::DenseMap<const IdentifierInfo*, LoopRuleEntry> LoopRules;
+
+  struct LazyRuleEntry {
+    Token NameTok;
+    /// Where the rule (i.e. its argument list) starts
+    SourceLocation BeginLoc;
+    const MacroInfo* Placeholder;
+  };
+
+  /// Rules that haven't been parsed yet, indexed by their names
+  llvm::DenseMap<const IdentifierInfo*, LazyRuleEntry> LazyRules;
+
+  unsigned NumMaterializedRules;
+
+  struct DefinedRuleEntry {
+    /// See NacroRuleParser::getFingerprint
+    size_t Fingerprint;
+    /// The macro exported by this rule (or its placeholder)
+    const MacroInfo* MI;
+    SourceLocation BeginLoc;
+    /// null if it's a lazy rule that hasn't been parsed
+    NacroRule* Rule;
+    /// Whether it has ever been expanded
+    bool Invoked;
+  };
+
+  /// Latest definition of every rule, indexed by their names.
+  /// Such that defining the same rule again (e.g. including a header
+  /// without include guards) costs nothing.
+  llvm::DenseMap<const IdentifierInfo*, DefinedRuleEntry> DefinedRules;
+
+  unsigned NumDuplicatedRules, NumConflictingRules;
+
+  /// States of a name saved by `#pragma nacro push`
+  struct SavedRule {
+    /// The macro defined at that time, which is not
+    /// necessarily a rule. Or null if there was none.
+    MacroInfo* MI;
+    llvm::Optional<DefinedRuleEntry> Defined;
+    llvm::Optional<LoopRuleEntry> Loop;
+    llvm::Optional<LazyRuleEntry> Lazy;
+  };
+
+  llvm::DenseMap<const IdentifierInfo*,
+                 llvm::SmallVector<SavedRule, 1>> SavedRules;
+
+  unsigned NumRetiredRules;
+
+  /// Forget everything about the current rule named \p II, including
+  /// its memoized expansions. The rule itself and its verifier interval
+  /// are released as well if it has never been expanded (and is not
+  /// saved by any push).
+  /// Note that the macro is left untouched.
+  void RetireRule(const IdentifierInfo* II);
+
+public:
+  struct CachedExpansion {
+    /// Serialized actual arguments. In case of hash collision
+    std::string ArgsKey;
+
+    /// Expanded tokens before locations are remapped
+    std::vector<Token> Tokens;
+
+    /// Offsets in Tokens and the indices of (non-stringified) formal
+    /// parameters substituted there. Since these tokens carry the
+    /// locations of the invocation, they need to be patched on reuse.
+    std::vector<std::pair<unsigned, unsigned>> ParamSlots;
+
+    /// Offsets in Tokens and the indices of the template slots of
+    /// stringified literals, whose expansion locations are created
+    /// on every reuse.
+    std::vector<std::pair<unsigned, unsigned>> StrSlots;
+  };
+
+private:
+  /// Memoized expansions of looped rules, keyed by the rule
+  /// and hash of the actual arguments
+  llvm::DenseMap<std::pair<const NacroRule*, size_t>,
+                 CachedExpansion> ExpansionCache;
+
+  /// Stop memoizing once this number of tokens are cached
+  static constexpr size_t MaxCachedTokens = 1 << 20;
+  size_t NumCachedTokens;
+
+  unsigned NumExpansionCacheHits, NumExpansionCacheMisses;
+
+  /// String literals created by stringification, indexed by
+  /// the serialized tokens being stringified. Such that every
+  /// distinct literal is only written into the scratch buffer once.
+  /// Tokens are located at their spelling in the scratch buffer.
+  llvm::StringMap<Token> StringifiedTokens;
+
+  unsigned NumStringifiedHits;
+  size_t NumScratchBytesSaved;
+
+  /// Number of tokens produced by looped rules so far
+  size_t NumExpandedTokens;
+
+  unsigned NextExpansionID;
+
+  /// File offsets (of the expansion locations) where rules
+  /// are invoked, sorted within each FileID
+  llvm::DenseMap<FileID, llvm::SmallVector<unsigned, 4>> InvocationOffsets;
+
+  /// Records for Options.TraceFile, which are written all
+  /// at once at the end of the main file
+  std::string TraceBuffer;
+
+  explicit NacroContext(Preprocessor& PP);
+
+  friend struct NacroPPCallbacks;
+
+public:
+  ~NacroContext();
+
+  /// Get the context associated with \p PP. Create one
+  /// (and install the PPCallbacks) if there isn't any.
+  /// It takes a process-wide lock, so look it up once and
+  /// pass it around instead of calling this on hot paths.
+  static NacroContext& Get(Preprocessor& PP);
+
+  Preprocessor& getPreprocessor() { return PP; }
+
+  /// Allocate a rule whose lifetime is bound to this context
+  NacroRule* CreateRule(IdentifierInfo* NameII);
+
+  /// Release a rule that is never exported
+  void DestroyRule(NacroRule* Rule);
+
+  NacroRuleDepot& getRuleDepot() { return *RuleDepot; }
+
+  NacroOptions& getOptions() { return Options; }
+  const NacroOptions& getOptions() const { return Options; }
+
+  void AddLoopRule(NacroRule* Rule, const MacroInfo* Placeholder);
+
+  /// null if there is no loop rule named \p II or
+  /// \p MI is not its placeholder macro
+  NacroRule* getLoopRule(const IdentifierInfo* II,
+                         const MacroInfo* MI) const {
+    auto It = LoopRules.find(II);
+    if(It == LoopRules.end() || It->second.Placeholder != MI)
+      return nullptr;
+    return It->second.Rule;
+  }
+
+  size_t loop_rules_size() const { return LoopRules.size(); }
+
+  /// Return true if the rule named by \p NameTok, which starts at
+  /// \p BeginLoc, has exactly the same \p Fingerprint as the current
+  /// definition of that name. In which case the new one can be dropped.
+  /// Warn if it's redefining a different rule.
+  bool isDuplicatedRule(const Token& NameTok, size_t Fingerprint,
+                        SourceLocation BeginLoc);
+
+  /// Record the definition of \p II, which exports the current macro
+  /// of that name
+  void AddDefinedRule(const IdentifierInfo* II, size_t Fingerprint,
+                      SourceLocation BeginLoc, NacroRule* Rule);
+
+  /// Return true and mark the rule as invoked if \p MI is
+  /// exported by a rule named \p II
+  bool MarkRuleInvoked(const IdentifierInfo* II, const MacroInfo* MI) {
+    auto It = DefinedRules.find(II);
+    if(It == DefinedRules.end() || It->second.MI != MI) return false;
+    It->second.Invoked = true;
+    return true;
+  }
+
+  /// `#pragma nacro undef <name>`.
+  /// Undefine the rule named by \p NameTok and release its resources.
+  /// Return false if it's not a rule.
+  bool UndefRule(const Token& NameTok);
+
+  /// `#pragma nacro push <name>`.
+  /// Save the current definition of \p NameTok, which
+  /// doesn't need to be a rule.
+  void PushRule(const Token& NameTok);
+
+  /// `#pragma nacro pop <name>`.
+  /// Retire the current rule named by \p NameTok, and restore
+  /// the definition saved by the last push.
+  /// Return false if there is no such push.
+  bool PopRule(const Token& NameTok);
+
+  /// Define a placeholder macro for the rule named by \p NameTok,
+  /// which starts at \p BeginLoc. Its invocations will be reported
+  /// to MaterializeLazyRule.
+  void AddLazyRule(const Token& NameTok, SourceLocation BeginLoc,
+                   size_t Fingerprint);
+
+  bool isLazyRule(const IdentifierInfo* II, const MacroInfo* MI) const {
+    auto It = LazyRules.find(II);
+    return It != LazyRules.end() && It->second.Placeholder == MI;
+  }
+
+  /// Parse and expand the lazy rule invoked by \p MacroNameToken.
+  /// Then re-inject the invocation such that the real rule
+  /// will be expanded instead of the placeholder.
+  void MaterializeLazyRule(const Token& MacroNameToken,
+                           SourceRange Range,
+                           const MacroArgs* Args);
+
+  /// Return the previous expansion of \p Rule with the same (serialized)
+  /// actual arguments \p ArgsKey, or null if there is none.
+  /// Update the hit / miss counters as well.
+  const CachedExpansion* lookupExpansion(const NacroRule* Rule,
+                                         llvm::StringRef ArgsKey);
+
+  void cacheExpansion(const NacroRule* Rule, llvm::StringRef ArgsKey,
+                      llvm::ArrayRef<Token> Tokens,
+                      llvm::ArrayRef<std::pair<unsigned, unsigned>> ParamSlots,
+                      llvm::ArrayRef<std::pair<unsigned, unsigned>> StrSlots);
+
+  /// Return the string literal created from the same (serialized)
+  /// tokens \p Key, or null if there is none.
+  /// Note that the returned token is located in the scratch buffer,
+  /// callers need to create an expansion location for their own
+  /// stringification site.
+  const Token* lookupStringified(llvm::StringRef Key);
+
+  void cacheStringified(llvm::StringRef Key, const Token& StrTok) {
+    StringifiedTokens.insert({Key, StrTok});
+  }
+
+  /// Number of tokens the next invocation can produce before
+  /// hitting the per-TU limit
+  size_t getTUExpansionBudget() const {
+    if(!Options.MaxTUExpansionTokens) return SIZE_MAX;
+    if(NumExpandedTokens >= Options.MaxTUExpansionTokens) return 0;
+    return Options.MaxTUExpansionTokens - NumExpandedTokens;
+  }
+
+  void AddExpandedTokens(size_t N) { NumExpandedTokens += N; }
+
+  unsigned getNextExpansionID() { return ++NextExpansionID; }
+
+  /// Record a rule invocation at \p Loc
+  void AddInvocation(SourceLocation Loc);
+
+  /// Return true if any rule is invoked within \p SR. Ranges
+  /// spanning multiple files are conservatively treated as true
+  bool hasInvocationIn(SourceRange SR) const;
+
+  /// Add a trace record for the invocation of \p MI, which takes
+  /// \p Microseconds. \p LoopTokens is the number of tokens expanded
+  /// if it's a looped rule. Otherwise, it's estimated from the macro.
+  void TraceInvocation(const Token& MacroNameToken, const MacroInfo* MI,
+                       const MacroArgs* Args,
+                       llvm::Optional<size_t> LoopTokens,
+                       double Microseconds);
+
+  /// Append trace records to Options.TraceFile
+  void FlushTrace();
+
+  void PrintStats(llvm::raw_ostream& OS) const;
+};
+} // end namespace clang
+#endif
@@ -1,13 +1,20 @@
 #include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/SmallBitVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/SmallSet.h"
+#include "llvm/ADT/SmallString.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/STLExtras.h"
 #include "clang/Lex/MacroInfo.h"
 #include "clang/Lex/MacroArgs.h"
-#include "clang/Lex/PPCallbacks.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/raw_ostream.h"
+#include "NacroContext.h"
 #include "NacroExpanders.h"
+#include <algorithm>
+#include <cstdint>
 #include <iterator>
+#include <memory>
 #include <vector>
 
 using namespace clang;
@@ -34,224 +41,521 @@ DefMacroDirective* CreateMacroDirective(Preprocessor& PP, IdentifierInfo* Name,
   return PP.appendDefMacroDirective(Name, MI);
 }
 
+static Token CreatePunctuator(tok::TokenKind Kind, SourceLocation Loc) {
+  Token Tok;
+  Tok.startToken();
+  Tok.setKind(Kind);
+  Tok.setLength(1);
+  Tok.setLocation(Loc);
+  return Tok;
+}
+
+NacroRuleExpander::NacroRuleExpander(NacroRule* Rule, NacroContext& Ctx)
+  : Rule(Rule), Ctx(Ctx), PP(Ctx.getPreprocessor()) {}
+
+NacroRuleExpander::NacroRuleExpander(NacroRule* Rule, Preprocessor& PP)
+  : NacroRuleExpander(Rule, NacroContext::Get(PP)) {}
+
 Error NacroRuleExpander::ReplacementProtecting() {
   using namespace llvm;
-  DenseMap<IdentifierInfo*, typename NacroRule::Replacement> IdentMap;
+  TimeTraceScope TimeScope("NacroProtectRule", Rule->getNameStr());
+  using RTy = typename NacroRule::ReplacementTy;
+  DenseMap<IdentifierInfo*, RTy> IdentMap;
   for(auto& R : Rule->replacements()) {
     if(R.Identifier && !R.VarArgs) {
-      IdentMap.insert({R.Identifier, R});
+      IdentMap.insert({R.Identifier, R.Type});
     }
   }
   if(IdentMap.empty()) return Error::success();
 
-  for(auto TI = Rule->token_begin(); TI != Rule->token_end();) {
-    auto Tok = *TI;
+  ArrayRef<Token> Tokens(Rule->token_begin(), Rule->token_end());
+  auto getProtection = [&](unsigned Idx) -> RTy {
+    const auto& Tok = Tokens[Idx];
+    if(Tok.isNot(tok::identifier)) return RTy::UNKNOWN;
+    auto It = IdentMap.find(Tok.getIdentifierInfo());
+    if(It == IdentMap.end()) return RTy::UNKNOWN;
+    // Don't add parens if it's gonna be stringify later
+    if(It->second == RTy::Expr &&
+       Idx > 0 && Tokens[Idx - 1].is(tok::hash))
+      return RTy::UNKNOWN;
+    return It->second;
+  };
+
+  // Count the tokens we're gonna add first, such that
+  // the new body can be built in one allocation
+  unsigned NumNewTokens = 0;
+  for(unsigned I = 0, E = Tokens.size(); I < E; ++I) {
+    switch(getProtection(I)) {
+    case RTy::Expr: NumNewTokens += 2; break;
+    case RTy::Stmt: NumNewTokens += 1; break;
+    default: break;
+    }
+  }
+  if(!NumNewTokens) return Error::success();
+
+  SmallVector<Token, 16> NewTokens;
+  NewTokens.reserve(Tokens.size() + NumNewTokens);
+  for(unsigned I = 0, E = Tokens.size(); I < E; ++I) {
+    const auto& Tok = Tokens[I];
     auto TokLoc = Tok.getLocation();
-    if(Tok.is(tok::identifier)) {
-      auto* II = Tok.getIdentifierInfo();
-      assert(II);
-      if(IdentMap.count(II)) {
-        auto& R = IdentMap[II];
-        using RTy = typename NacroRule::ReplacementTy;
-        switch(R.Type) {
-        case RTy::Expr: {
-          // Don't add parens if it's gonna be stringify later
-          if(TI != Rule->token_begin()) {
-            auto PrevTI = TI;
-            --PrevTI;
-            if(PrevTI->is(tok::hash)) {
-              ++TI;
-              continue;
-            }
-          }
-
-          ++TI;
-          Token LParen, RParen;
-          RParen.startToken();
-          RParen.setKind(tok::r_paren);
-          RParen.setLength(1);
-          RParen.setLocation(TokLoc.getLocWithOffset(1));
-          TI = Rule->insert_token(TI, RParen);
-          --TI;
-          LParen.startToken();
-          LParen.setKind(tok::l_paren);
-          LParen.setLength(1);
-          LParen.setLocation(TokLoc.getLocWithOffset(-1));
-          TI = Rule->insert_token(TI, LParen);
-          // skip expr and r_paren
-          for(int i = 0; i < 3; ++i) ++TI;
-          break;
-        }
-        case RTy::Stmt: {
-          ++TI;
-          Token Semi;
-          Semi.startToken();
-          Semi.setKind(tok::semi);
-          Semi.setLength(1);
-          Semi.setLocation(TokLoc.getLocWithOffset(1));
-          TI = Rule->insert_token(TI, Semi);
-          ++TI;
-          break;
-        }
-        default: ++TI;
-        }
-        continue;
-      }
+    switch(getProtection(I)) {
+    case RTy::Expr:
+      NewTokens.push_back(CreatePunctuator(tok::l_paren,
+                                           TokLoc.getLocWithOffset(-1)));
+      NewTokens.push_back(Tok);
+      NewTokens.push_back(CreatePunctuator(tok::r_paren,
+                                           TokLoc.getLocWithOffset(1)));
+      break;
+    case RTy::Stmt:
+      NewTokens.push_back(Tok);
+      NewTokens.push_back(CreatePunctuator(tok::semi,
+                                           TokLoc.getLocWithOffset(1)));
+      break;
+    default:
+      NewTokens.push_back(Tok);
     }
-    ++TI;
   }
+  Rule->swapTokens(NewTokens);
+
   return Error::success();
 }
 
-namespace {
-struct LoopExpandingPPCallbacks : public PPCallbacks {
-  LoopExpandingPPCallbacks(NacroRule* R, Preprocessor& PP)
-    : Rule(R), PP(PP) {
-    assert(Rule->hasVAArgs() && "No loops to expand from arguments");
-    llvm::transform(Rule->replacements(), std::back_inserter(UnexpArgsII),
-                    [](NacroRule::Replacement& R) {
-                      return R.Identifier;
-                    });
+NacroLoopExpander::NacroLoopExpander(NacroRule* R, NacroContext& Ctx)
+  : Rule(R), Ctx(Ctx), PP(Ctx.getPreprocessor()), Args(nullptr),
+    TokenBudget(SIZE_MAX), ExpansionID(0) {
+  assert((Rule->loop_empty() || Rule->hasVAArgs()) &&
+         "No loops to expand from arguments");
+}
+
+/// Write \p Tok in a form that two tokens have the same serialization
+/// iff they have the same kind, spelling and leading whitespace
+static void SerializeToken(const Token& Tok, Preprocessor& PP,
+                           llvm::raw_ostream& OS) {
+  OS << unsigned(Tok.getKind())
+     << (Tok.hasLeadingSpace()? '+' : '-');
+  if(auto* II = Tok.getIdentifierInfo()) {
+    OS << II->getName();
+  } else if(Tok.isLiteral()) {
+    if(const char* Data = Tok.getLiteralData())
+      OS << StringRef(Data, Tok.getLength());
+    else
+      OS << PP.getSpelling(Tok);
+  } else {
+    // Distinguish digraphs
+    OS << Tok.getLength();
+  }
+  OS << '\0';
+}
+
+bool NacroLoopExpander::SerializeArgs(SmallVectorImpl<char>& Key) const {
+  // Locals are renamed differently on every expansion
+  if(!Rule->local_empty()) return false;
+
+  llvm::raw_svector_ostream OS(Key);
+  for(unsigned I = 0, E = Rule->replacements_size(); I < E; ++I) {
+    for(const auto* Tok = Args->getUnexpArgument(I);
+        Tok->isNot(tok::eof); ++Tok) {
+      // Pre-expansion result depends on the macros in scope
+      if(auto* II = Tok->getIdentifierInfo())
+        if(II->hasMacroDefinition()) return false;
+      SerializeToken(*Tok, PP, OS);
+    }
+    // End of an argument
+    OS << '\n';
+  }
+  return true;
+}
+
+ArrayRef<Token> NacroLoopExpander::getExpandedArgument(unsigned ArgNo) {
+  const auto* ArgToks = Args->getUnexpArgument(ArgNo);
+  // Pre-expansion lexes the whole argument again, which is a waste
+  // for arguments that are merely identifiers or literals
+  if(!Args->ArgNeedsPreexpansion(ArgToks, PP))
+    return ArrayRef<Token>(ArgToks, MacroArgs::getArgLength(ArgToks) + 1);
+  return Args->getPreExpArgument(ArgNo, PP);
+}
+
+Token NacroLoopExpander::Stringify(const Token* ArgToks) {
+  SmallString<32> Key;
+  {
+    llvm::raw_svector_ostream OS(Key);
+    for(const auto* Tok = ArgToks; Tok->isNot(tok::eof); ++Tok)
+      SerializeToken(*Tok, PP, OS);
   }
+  if(const auto* StrTok = Ctx.lookupStringified(Key))
+    return *StrTok;
 
-  void ExpandsLoop(const NacroRule::Loop& LoopInfo,
-                   ArrayRef<Token> LoopBody,
-                   ArrayRef<std::vector<Token>> ExpVAArgs,
-                   SmallVectorImpl<Token>& OutputBuffer) {
-    auto* IndVarII = LoopInfo.InductionVar;
-    Token PrevTok, Tok;
-    for(const auto& Arg : ExpVAArgs) {
-      assert(Arg.size() > 0);
-
-      PrevTok.startToken();
-      PrevTok.setKind(tok::eof);
-      for(int I = 0, E = LoopBody.size(); I < E; ++I) {
-        if(I > 0) PrevTok = LoopBody[I - 1];
-        Tok = LoopBody[I];
-        if(Tok.is(tok::identifier) &&
-           Tok.getIdentifierInfo() == IndVarII) {
-          if(PrevTok.is(tok::hash)){
-            // Need to stringify
-            auto BeginLoc = PrevTok.getLocation(),
-                 EndLoc = Tok.getLocation();
-            auto StrTok = MacroArgs::StringifyArgument(Arg.data(), PP, false,
-                                                       BeginLoc, EndLoc);
-            // FIXME: Here is one of the most dirty workarounds in this
-            // project: Stringify can not be naturally dropped in here because
-            // we manually expand the VA arguments before stringify got
-            // applied on actual parameters. So the only way is to stringify
-            // ourself while we're manually expanding the VA arguments. But
-            // TokenLexer, which is the consumer of macro tokens, require
-            // every tokens in a macro comes from real text (i.e. isFileID
-            // needs to be true). But StrTok is born in scratch buffer. The
-            // workaround here is simply pick a random location in the macro
-            // and set it as StrTok's location. Which will 100% hinder the error
-            // message and debug experiences.
-            StrTok.setLocation(Tok.getLocation());
-            StrTok.setFlag(Token::StringifiedInMacro);
-            OutputBuffer.push_back(StrTok);
-          } else {
-            for(auto ArgTok : Arg) {
-              if(ArgTok.isNot(tok::eof)) {
-                ArgTok.setLocation(Tok.getLocation());
-                OutputBuffer.push_back(ArgTok);
-              }
-            }
-          }
-        } else {
-          // we will stringify by ourself
-          if(Tok.is(tok::hash)) continue;
-
-          OutputBuffer.push_back(Tok);
-        }
+  // Without an expansion range, the literal is located
+  // in the scratch buffer
+  auto StrTok = MacroArgs::StringifyArgument(ArgToks, PP, false,
+                                             SourceLocation(),
+                                             SourceLocation());
+  StrTok.setFlag(Token::StringifiedInMacro);
+  Ctx.cacheStringified(Key, StrTok);
+  return StrTok;
+}
+
+bool NacroLoopExpander::ExpandSlots(unsigned SlotBegin, unsigned SlotEnd,
+                                    SmallVectorImpl<Token>& OutputBuffer) {
+  using SlotTy = NacroRule::TemplateSlot;
+  auto Template = Rule->getTemplate();
+  for(auto SI = SlotBegin; SI < SlotEnd; ++SI) {
+    const auto& Slot = Template[SI];
+    switch(Slot.Kind) {
+    case SlotTy::Literal:
+      OutputBuffer.append(Rule->token_begin() + Slot.Begin,
+                          Rule->token_begin() + Slot.End);
+      break;
+    case SlotTy::Param: {
+      ParamSlots.push_back({OutputBuffer.size(), Slot.Begin});
+      // Drop the trailing eof
+      ArrayRef<Token> ExpArg = getExpandedArgument(Slot.Begin);
+      OutputBuffer.append(ExpArg.begin(), ExpArg.end() - 1);
+      break;
+    }
+    case SlotTy::StrParam: {
+      // Stringify uses the un-expanded argument
+      StrSlots.push_back({OutputBuffer.size(), SI});
+      OutputBuffer.push_back(Stringify(Args->getUnexpArgument(Slot.Begin)));
+      break;
+    }
+    case SlotTy::LoopVar: {
+      assert(LoopElements[Slot.Begin] && "Not inside the loop?");
+      for(const auto* Tok = LoopElements[Slot.Begin];
+          Tok->isNot(tok::eof); ++Tok) {
+        OutputBuffer.push_back(*Tok);
+        OutputBuffer.back().setLocation(Slot.Loc);
+      }
+      break;
+    }
+    case SlotTy::StrLoopVar: {
+      assert(LoopElements[Slot.Begin] && "Not inside the loop?");
+      StrSlots.push_back({OutputBuffer.size(), SI});
+      OutputBuffer.push_back(Stringify(LoopElements[Slot.Begin]));
+      break;
+    }
+    case SlotTy::Loop: {
+      for(auto Offset : VAElements) {
+        LoopElements[Slot.Begin] = &VATokens[Offset];
+        // Bail out as early as possible
+        if(!ExpandSlots(SI + 1, Slot.End, OutputBuffer)) return false;
       }
+      LoopElements[Slot.Begin] = nullptr;
+      // Skip the loop body
+      SI = Slot.End - 1;
+      break;
+    }
+    case SlotTy::Local: {
+      auto*& NewII = LocalNames[Slot.Begin];
+      if(!NewII) {
+        SmallString<32> NewName;
+        // Identifiers starting with double underscores
+        // are reserved to the implementation
+        (Twine("nacro_") + Rule->getLocal(Slot.Begin)->getName() +
+         "_" + Twine(ExpansionID)).toVector(NewName);
+        NewII = PP.getIdentifierInfo(NewName);
+      }
+      OutputBuffer.push_back(*(Rule->token_begin() + Slot.End));
+      OutputBuffer.back().setIdentifierInfo(NewII);
+      break;
+    }
     }
   }
+  return OutputBuffer.size() <= TokenBudget;
+}
+
+void NacroLoopExpander::RemapLocations(SourceRange Range,
+                                       MutableArrayRef<Token> Tokens) {
+  // Just like what TokenLexer does to macro bodies, create a single
+  // expansion SLocEntry covering the entire rule and rebase every
+  // token coming from the rule on it. So that diagnostics will show
+  // the invocation site.
+  auto& SM = PP.getSourceManager();
+  auto RuleRange = Rule->getSourceRange();
+  auto RuleBegin = RuleRange.getBegin(),
+       RuleEnd = RuleRange.getEnd();
+  SourceLocation ExpansionBegin;
+  unsigned RuleLength = 0;
+  if(RuleBegin.isFileID() && RuleEnd.isFileID() &&
+     SM.isWrittenInSameFile(RuleBegin, RuleEnd)) {
+    RuleLength = SM.getFileOffset(RuleEnd) - SM.getFileOffset(RuleBegin);
+    ExpansionBegin = SM.createExpansionLoc(RuleBegin,
+                                           Range.getBegin(),
+                                           Range.getEnd(),
+                                           RuleLength);
+  }
+  auto Remap = [&](SourceLocation Loc) -> SourceLocation {
+    unsigned RelOffset;
+    if(ExpansionBegin.isValid() && Loc.isValid() &&
+       SM.isInSLocAddrSpace(Loc, RuleBegin, RuleLength, &RelOffset))
+      return ExpansionBegin.getLocWithOffset(RelOffset);
+    return Loc;
+  };
+  for(auto& Tok : Tokens)
+    Tok.setLocation(Remap(Tok.getLocation()));
 
-  void MacroExpands(const Token& MacroNameToken,
-                    const MacroDefinition& MD,
-                    SourceRange Range,
-                    const MacroArgs* ConstArgs) override {
-    // FIXME: Is this safe?
-    auto* Args = const_cast<MacroArgs*>(ConstArgs);
-    auto* MacroII = MacroNameToken.getIdentifierInfo();
-    assert(MacroII);
-    if(MacroII != Rule->getName()) return;
-    // Number of un-expanded arguments
-    assert(Args->getNumMacroArguments() == Rule->replacements_size());
-
-    // If there is a VAArgs, it must be the last (formal) argument
-    auto VAArgsIdx = Rule->replacements_size() - 1;
-    auto& VAReplacement = Rule->getReplacement(VAArgsIdx);
-    assert(VAReplacement.VarArgs);
-    const auto& RawExpVAArgs
-      = Args->getPreExpArgument(VAArgsIdx, PP);
-    SmallVector<std::vector<Token>, 4> ExpVAArgs;
-    std::vector<Token> VABuffer;
-    for(const auto& Tok : RawExpVAArgs) {
-      if(!Tok.isOneOf(tok::eof, tok::comma)) {
-        VABuffer.push_back(Tok);
-      } else {
-        // MacroArgs::StringifyArgument require
-        // input actual paramater list to be ended
-        // by tok::eof
-        Token EofTok;
-        EofTok.startToken();
-        EofTok.setKind(tok::eof);
-        VABuffer.push_back(EofTok);
-
-        ExpVAArgs.push_back(VABuffer);
-        VABuffer.clear();
+  // Stringified literals are spelled in the scratch buffer. Like what
+  // Preprocessor::CreateString does, expand them from their `$str`,
+  // which is now rebased on the invocation as well.
+  auto Template = Rule->getTemplate();
+  for(const auto& SS : StrSlots) {
+    const auto& Slot = Template[SS.second];
+    auto& Tok = Tokens[SS.first];
+    if(Slot.HashLoc.isInvalid()) continue;
+    Tok.setLocation(SM.createExpansionLoc(Tok.getLocation(),
+                                          Remap(Slot.HashLoc),
+                                          Remap(Slot.Loc),
+                                          Tok.getLength()));
+  }
+}
+
+void NacroLoopExpander::SplitVAArgs() {
+  // If there is a VAArgs, it must be the last (formal) argument
+  auto VAArgsIdx = Rule->replacements_size() - 1;
+  auto& VAReplacement = Rule->getReplacement(VAArgsIdx);
+  assert(VAReplacement.VarArgs);
+  ArrayRef<Token> RawExpVAArgs = getExpandedArgument(VAArgsIdx);
+
+  // Split VAArgs into elements by replacing top-level commas
+  // with eof, since MacroArgs::StringifyArgument require
+  // input actual paramater list to be ended by tok::eof.
+  // Note that the resulting buffer has exactly the same size
+  // as the original one.
+  VATokens.assign(RawExpVAArgs.begin(), RawExpVAArgs.end());
+  VAElements.clear();
+  VAElements.push_back(0);
+  unsigned ParenDepth = 0;
+  for(unsigned I = 0, E = VATokens.size(); I < E; ++I) {
+    auto& Tok = VATokens[I];
+    if(Tok.is(tok::l_paren)) {
+      ++ParenDepth;
+    } else if(Tok.is(tok::r_paren)) {
+      if(ParenDepth) --ParenDepth;
+    } else if(Tok.is(tok::comma) && !ParenDepth) {
+      Tok.startToken();
+      Tok.setKind(tok::eof);
+      VAElements.push_back(I + 1);
+    }
+  }
+  assert(!VATokens.empty() && VATokens.back().is(tok::eof));
+
+  assert(llvm::all_of(Rule->loops(),
+                      [&VAReplacement](const NacroRule::Loop& LP) {
+                        return LP.IterRange == VAReplacement.Identifier;
+                      }) && "Iterating on non VAArgs variable");
+}
+
+bool NacroLoopExpander::ExpandTokens(SmallVectorImpl<Token>& OutputBuffer) {
+  if(Rule->hasVAArgs())
+    SplitVAArgs();
+  LoopElements.assign(Rule->loop_size(), nullptr);
+  LocalNames.assign(Rule->local_size(), nullptr);
+
+  ParamSlots.clear();
+  StrSlots.clear();
+  return ExpandSlots(0, Rule->getTemplate().size(), OutputBuffer);
+}
+
+void NacroLoopExpander::ExpandInvocation(const Token& MacroNameToken,
+                                         SourceRange Range,
+                                         MacroArgs* ActualArgs) {
+  auto* MacroII = MacroNameToken.getIdentifierInfo();
+  assert(MacroII && MacroII == Rule->getName());
+  Args = ActualArgs;
+  // Number of un-expanded arguments
+  assert(Args->getNumMacroArguments() == Rule->replacements_size());
+
+  if(!Rule->local_empty())
+    ExpansionID = Ctx.getNextExpansionID();
+
+  // Identical actual arguments always produce identical tokens,
+  // unless they contain macros.
+  SmallString<64> ArgsKey;
+  bool Cacheable = SerializeArgs(ArgsKey);
+  const NacroContext::CachedExpansion* Cached = nullptr;
+  if(Cacheable)
+    Cached = Ctx.lookupExpansion(Rule, ArgsKey);
+
+  // Stop before a pathological invocation takes up all the memory
+  const auto& Options = Ctx.getOptions();
+  auto TUBudget = Ctx.getTUExpansionBudget();
+  size_t ExpansionLimit = Options.MaxExpansionTokens?
+                          Options.MaxExpansionTokens : SIZE_MAX;
+  bool TULimited = TUBudget < ExpansionLimit;
+  TokenBudget = TULimited? TUBudget : ExpansionLimit;
+
+  SmallVector<Token, 16> ExpTokens;
+  bool WithinBudget;
+  if(Cached) {
+    WithinBudget = Cached->Tokens.size() <= TokenBudget;
+    if(WithinBudget) {
+      ExpTokens.append(Cached->Tokens.begin(), Cached->Tokens.end());
+      // Substituted arguments only differ in their locations
+      for(const auto& PS : Cached->ParamSlots) {
+        const auto* ArgToks = Args->getUnexpArgument(PS.second);
+        std::copy(ArgToks, ArgToks + MacroArgs::getArgLength(ArgToks),
+                  ExpTokens.begin() + PS.first);
       }
+      StrSlots.assign(Cached->StrSlots.begin(), Cached->StrSlots.end());
     }
+  } else {
+    WithinBudget = ExpandTokens(ExpTokens);
+    if(WithinBudget && Cacheable)
+      Ctx.cacheExpansion(Rule, ArgsKey, ExpTokens, ParamSlots, StrSlots);
+  }
+  if(!WithinBudget) {
+    auto& Diag = PP.getDiagnostics();
+    unsigned DiagID;
+    if(TULimited)
+      DiagID = Diag.getCustomDiagID(DiagnosticsEngine::Error,
+                                    "expanding nacro rule '%0' exceeds "
+                                    "the limit of %1 tokens per "
+                                    "translation unit");
+    else
+      DiagID = Diag.getCustomDiagID(DiagnosticsEngine::Error,
+                                    "expanding nacro rule '%0' exceeds "
+                                    "the limit of %1 tokens");
+    Diag.Report(MacroNameToken.getLocation(), DiagID)
+      << MacroII->getName()
+      << (TULimited? Options.MaxTUExpansionTokens
+                   : Options.MaxExpansionTokens);
+    return;
+  }
+  Ctx.AddExpandedTokens(ExpTokens.size());
+  if(ExpTokens.empty()) return;
+
+  RemapLocations(Range, ExpTokens);
 
-    // Create a new MacroInfo for this iteration number
-    SmallVector<Token, 16> ExpTokens;
-    auto LPI = Rule->loop_begin();
-    for(auto TokIdx = 0; TokIdx < Rule->token_size(); ++TokIdx) {
-      auto Tok = Rule->getToken(TokIdx);
-      if(Tok.is(tok::annot_pragma_loop_hint)) {
-        assert(LPI != Rule->loop_end() &&
-               "No loop in this rule or loop out-of-bound?");
-        const auto& LP = *(LPI++);
-        assert(VAReplacement.Identifier == LP.IterRange &&
-               "Iterating on non VAArgs variable");
-
-        // Extract loop body
-        SmallVector<Token, 8> LoopBody;
-        Tok = Rule->getToken(++TokIdx);
-        while(Tok.isNot(tok::annot_pragma_loop_hint)) {
-          LoopBody.push_back(Tok);
-          Tok = Rule->getToken(++TokIdx);
-        }
-        ExpandsLoop(LP, LoopBody, ExpVAArgs, ExpTokens);
-      } else {
-        ExpTokens.push_back(Tok);
+  // Push the expanded tokens directly into the lexer rather than
+  // storing them in the (placeholder) macro, which remains empty.
+  // So the macro table stays the same size no matter how many times
+  // this rule is invoked. The tokens will be released once they're
+  // all lexed.
+  auto NumTokens = ExpTokens.size();
+  auto TokenStream = std::make_unique<Token[]>(NumTokens);
+  std::copy(ExpTokens.begin(), ExpTokens.end(), TokenStream.get());
+  PP.EnterTokenStream(std::move(TokenStream), NumTokens,
+                      /*DisableMacroExpansion=*/false,
+                      /*IsReinject=*/false);
+}
+
+/// Specifiers and qualifiers that can start a declaration
+static bool isDeclSpecifier(const Token& Tok) {
+  return Tok.isOneOf(tok::kw_void, tok::kw_char, tok::kw_short, tok::kw_int,
+                     tok::kw_long, tok::kw_float, tok::kw_double,
+                     tok::kw_signed, tok::kw_unsigned, tok::kw__Bool,
+                     tok::kw_bool, tok::kw_auto, tok::kw_const,
+                     tok::kw_volatile, tok::kw_restrict, tok::kw_static,
+                     tok::kw_register);
+}
+
+void NacroRuleExpander::CollectLocalDecls() {
+  llvm::SmallPtrSet<const IdentifierInfo*, 4> NonLocals;
+  NonLocals.insert(Rule->getName());
+  for(const auto& R : Rule->replacements())
+    NonLocals.insert(R.Identifier);
+  for(const auto& LP : Rule->loops())
+    NonLocals.insert(LP.InductionVar);
+
+  ArrayRef<Token> Tokens(Rule->token_begin(), Rule->token_end());
+  auto E = Tokens.size();
+  // Whether Tokens[Idx] starts a statement
+  auto isStmtBegin = [&](unsigned Idx) -> bool {
+    return Idx == 0 ||
+           Tokens[Idx - 1].isOneOf(tok::semi, tok::l_brace, tok::r_brace,
+                                   tok::annot_pragma_loop_hint);
+  };
+  // Whether Tokens[Idx] is a type name like `foo_t`, `struct foo`
+  auto isTypeName = [&](unsigned Idx) -> bool {
+    const auto& Tok = Tokens[Idx];
+    if(isDeclSpecifier(Tok)) return true;
+    if(Tok.isNot(tok::identifier) ||
+       NonLocals.count(Tok.getIdentifierInfo())) return false;
+    return isStmtBegin(Idx) ||
+           Tokens[Idx - 1].isOneOf(tok::kw_struct, tok::kw_union,
+                                   tok::kw_enum) ||
+           isDeclSpecifier(Tokens[Idx - 1]);
+  };
+
+  // Whether the brace at Tokens[Idx] opens a struct or union body
+  auto isRecordBody = [&](unsigned Idx) -> bool {
+    if(Idx && Tokens[Idx - 1].isOneOf(tok::kw_struct, tok::kw_union))
+      return true;
+    return Idx > 1 && Tokens[Idx - 1].is(tok::identifier) &&
+           Tokens[Idx - 2].isOneOf(tok::kw_struct, tok::kw_union);
+  };
+
+  // It's only a heuristic: Looking for `<type> [*...] <identifier>`
+  // followed by an initializer, a semicolon, a comma or an array
+  // declarator. Declarations after a comma are also covered.
+  // Members are never renamed, since their uses (e.g. `s.x`) aren't.
+  bool InDeclList = false;
+  unsigned ParenDepth = 0;
+  // Whether each enclosing brace opens a record body
+  SmallVector<bool, 4> BraceStack;
+  unsigned RecordDepth = 0;
+  // Index of the brace closing the last record body, which can be
+  // followed by declarators like `struct { ... } x;`
+  unsigned RecordEnd = E;
+  for(unsigned I = 0; I < E; ++I) {
+    const auto& Tok = Tokens[I];
+    if(Tok.is(tok::semi)) {
+      InDeclList = false;
+      continue;
+    }
+    if(Tok.isOneOf(tok::l_brace, tok::r_brace)) {
+      if(Tok.is(tok::l_brace)) {
+        BraceStack.push_back(isRecordBody(I));
+        RecordDepth += BraceStack.back();
+      } else if(!BraceStack.empty()) {
+        if(BraceStack.back()) RecordEnd = I;
+        RecordDepth -= BraceStack.pop_back_val();
       }
+      InDeclList = false;
+      ParenDepth = 0;
+      continue;
+    }
+    if(RecordDepth) continue;
+    if(Tok.is(tok::l_paren)) {
+      ++ParenDepth;
+      continue;
     }
+    if(Tok.is(tok::r_paren)) {
+      if(ParenDepth) --ParenDepth;
+      continue;
+    }
+    if(Tok.isNot(tok::identifier) || !I || I + 1 >= E ||
+       NonLocals.count(Tok.getIdentifierInfo()))
+      continue;
+    if(!Tokens[I + 1].isOneOf(tok::equal, tok::semi,
+                              tok::comma, tok::l_square))
+      continue;
 
-    auto* MI = MD.getMacroInfo();
-    llvm::for_each(ExpTokens, [&MI](const Token& Tok) {
-                    MI->AddTokenToBody(Tok);
-                   });
+    // Skip pointer declarators
+    unsigned J = I - 1;
+    while(J > 0 && Tokens[J].isOneOf(tok::star, tok::kw_const,
+                                     tok::kw_volatile, tok::kw_restrict))
+      --J;
+    bool IsDecl = (InDeclList && !ParenDepth && Tokens[J].is(tok::comma)) ||
+                  J == RecordEnd ||
+                  ((J < I - 1 || Tokens[J].isNot(tok::identifier))?
+                   isTypeName(J) :
+                   // `foo_t x` is always a declaration
+                   !NonLocals.count(Tokens[J].getIdentifierInfo()));
+    if(!IsDecl) continue;
 
-    // Create an empty macro for next expansion
-    CreateMacroDirective(PP, MacroII,
-                         Rule->getBeginLoc(),
-                         UnexpArgsII, {}, true);
+    Rule->AddLocal(Tok.getIdentifierInfo());
+    InDeclList = true;
   }
-
-private:
-  NacroRule* Rule;
-  Preprocessor& PP;
-  SmallVector<IdentifierInfo*, 4> UnexpArgsII;
-};
-} // end anonymous namespace
+}
 
 Error NacroRuleExpander::Expand() {
   if(auto E = ReplacementProtecting())
     return E;
 
+  if(Ctx.getOptions().Hygiene)
+    CollectLocalDecls();
+
   SmallVector<IdentifierInfo*, 2> ReplacementsII;
   llvm::transform(Rule->replacements(), std::back_inserter(ReplacementsII),
                   [](NacroRule::Replacement& R) {
@@ -265,12 +569,22 @@ Error NacroRuleExpander::Expand() {
                                          Rule->token_end()));
   }
 
-  if(!Rule->loop_empty()) {
-    // Create a placeholder macro first
-    CreateMacroDirective(PP, Rule->getName(), Rule->getBeginLoc(),
-                         ReplacementsII, {}, true);
-    PP.addPPCallbacks(
-      std::make_unique<LoopExpandingPPCallbacks>(Rule, PP));
+  if(Rule->needsPPHooks()) {
+    // Just like normal macros, self-references in the expanded
+    // tokens should never be expanded again
+    for(auto& Tok : Rule->tokens()) {
+      if(Tok.is(tok::identifier) &&
+         Tok.getIdentifierInfo() == Rule->getName())
+        Tok.setFlag(Token::DisableExpand);
+    }
+
+    Rule->BuildTemplate();
+
+    // Create an empty placeholder macro. The actual tokens
+    // will be injected into the lexer on every invocations
+    auto* MD = CreateMacroDirective(PP, Rule->getName(), Rule->getBeginLoc(),
+                                    ReplacementsII, {}, Rule->hasVAArgs());
+    Ctx.AddLoopRule(Rule, MD->getInfo());
   }
 
   return Error::success();
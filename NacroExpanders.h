@@ -1,11 +1,18 @@
 #ifndef NACRO_NACRO_EXPANDERS_H
 #define NACRO_NACRO_EXPANDERS_H
 #include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/Support/Error.h"
+#include "clang/Lex/MacroArgs.h"
 #include "clang/Lex/Preprocessor.h"
 #include "NacroRule.h"
+#include <utility>
+#include <vector>
 
 namespace clang {
+// Forward Declarations
+class NacroContext;
+
 /// Inject nacro definition into token stream.
 /// Currently it will do some simple protections, adding
 /// paran for expressions for example. As well as instantiating
@@ -13,20 +20,104 @@ namespace clang {
 class NacroRuleExpander {
   NacroRule* Rule;
 
+  NacroContext& Ctx;
+
   Preprocessor& PP;
 
 public:
-  NacroRuleExpander(NacroRule* Rule, Preprocessor& PP)
-    : Rule(Rule),
-      PP(PP) {}
+  NacroRuleExpander(NacroRule* Rule, NacroContext& Ctx);
+  /// Look up the NacroContext of \p PP, prefer the other
+  /// constructor if the context is at hand
+  NacroRuleExpander(NacroRule* Rule, Preprocessor& PP);
 
   llvm::Error ReplacementProtecting();
 
+  /// Find identifiers declared within the rule body, which are
+  /// going to be renamed on every expansion. (i.e. hygiene mode)
+  void CollectLocalDecls();
+
   llvm::Error Expand();
 
   inline NacroRule* getNacroRule() {
     return Rule;
   }
 };
+
+/// Instantiate loops and rename local declarations in a nacro rule
+/// for one of its invocations.
+/// Note that this class doesn't install any PPCallbacks, it's
+/// NacroContext's job to dispatch invocations to their rules.
+class NacroLoopExpander {
+  NacroRule* Rule;
+
+  NacroContext& Ctx;
+
+  Preprocessor& PP;
+
+  /// Actual arguments of the invocation being expanded
+  MacroArgs* Args;
+
+  /// Offsets in the expanded tokens and the indices
+  /// of (non-stringified) formal parameters substituted there
+  llvm::SmallVector<std::pair<unsigned, unsigned>, 4> ParamSlots;
+
+  /// Offsets in the expanded tokens and the indices of the
+  /// template slots whose stringified literals are placed there
+  llvm::SmallVector<std::pair<unsigned, unsigned>, 4> StrSlots;
+
+  /// Serialize kinds and spellings of all the actual arguments into
+  /// \p Key. Return false if the expansion result can't be reused
+  /// by other invocations with identical arguments.
+  bool SerializeArgs(llvm::SmallVectorImpl<char>& Key) const;
+
+  /// The \p ArgNo-th actual argument, terminated by eof.
+  /// It's only pre-expanded if it contains any macro, otherwise
+  /// the un-expanded tokens are returned as-is.
+  llvm::ArrayRef<Token> getExpandedArgument(unsigned ArgNo);
+
+  /// Stringify \p ArgToks, which is terminated by eof. Reuse the
+  /// string literal created before if there is an identical one.
+  /// The literal is located in the scratch buffer, RemapLocations
+  /// expands it from the invocation later.
+  Token Stringify(const Token* ArgToks);
+
+  /// (Pre-expanded) elements of the VAArgs in a single buffer,
+  /// each of them is terminated by an eof
+  llvm::SmallVector<Token, 16> VATokens;
+  /// Offset of every element in VATokens
+  llvm::SmallVector<unsigned, 8> VAElements;
+
+  /// Element each loop is currently iterating on.
+  /// Indexed by loop number
+  llvm::SmallVector<const Token*, 2> LoopElements;
+
+  /// Maximum number of tokens this invocation can produce
+  size_t TokenBudget;
+
+  /// Unique number of this invocation, for renaming locals
+  unsigned ExpansionID;
+  /// New names of the locals, indexed by local number
+  llvm::SmallVector<IdentifierInfo*, 2> LocalNames;
+
+  void SplitVAArgs();
+
+  /// Expand template slots within [SlotBegin, SlotEnd).
+  /// Return false if it runs out of TokenBudget.
+  bool ExpandSlots(unsigned SlotBegin, unsigned SlotEnd,
+                   llvm::SmallVectorImpl<Token>& OutputBuffer);
+
+  bool ExpandTokens(llvm::SmallVectorImpl<Token>& OutputBuffer);
+
+  void RemapLocations(SourceRange Range, llvm::MutableArrayRef<Token> Tokens);
+
+public:
+  NacroLoopExpander(NacroRule* Rule, NacroContext& Ctx);
+
+  /// Instead of putting into a MacroInfo, the expanded tokens
+  /// are entered into the Preprocessor as a token stream
+  void ExpandInvocation(const Token& MacroNameToken,
+                        SourceRange Range,
+                        MacroArgs* ActualArgs);
+};
 } // end namespace clang
 #endif
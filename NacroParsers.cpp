@@ -1,7 +1,13 @@
 #include "clang/Basic/DiagnosticIDs.h"
 #include "clang/Basic/DiagnosticSema.h"
 
+#include "llvm/ADT/ScopeExit.h"
+#include "llvm/Support/TimeProfiler.h"
+
+#include "NacroContext.h"
 #include "NacroParsers.h"
+#include <iterator>
+#include <tuple>
 
 using namespace clang;
 
@@ -10,7 +16,13 @@ using llvm::ArrayRef;
 using llvm::Optional;
 
 NacroRuleParser::NacroRuleParser(Preprocessor& PP, ArrayRef<Token> Params)
-  : NacroParser(PP, Params) {
+  : NacroRuleParser(NacroContext::Get(PP), Params) {}
+
+NacroRuleParser::NacroRuleParser(NacroContext& Ctx, ArrayRef<Token> Params)
+  : NacroParser(Ctx.getPreprocessor(), Params),
+    Ctx(Ctx),
+    FileLexer(nullptr), RawLexedOffset(0),
+    Fingerprint(0) {
   IdentifierInfo* NameII = nullptr;
   if(PragmaParams.size() > 0) {
     auto NameTok = PragmaParams[0];
@@ -22,7 +34,124 @@ NacroRuleParser::NacroRuleParser(Preprocessor& PP, ArrayRef<Token> Params)
       assert(NameII);
     }
   }
-  CurrentRule = NacroRule::Create(NameII);
+  CurrentRule = Ctx.CreateRule(NameII);
+}
+
+/// Hash the kind and spelling of \p Tok. Identifiers are
+/// hashed in the same way whether they're resolved or not.
+static llvm::hash_code HashToken(const Token& Tok) {
+  if(Tok.is(tok::raw_identifier))
+    return llvm::hash_combine(tok::identifier, Tok.getRawIdentifier());
+  if(auto* II = Tok.getIdentifierInfo())
+    return llvm::hash_combine(tok::identifier, II->getName());
+  if(Tok.isLiteral() && Tok.getLiteralData())
+    return llvm::hash_combine(Tok.getKind(),
+                              StringRef(Tok.getLiteralData(),
+                                        Tok.getLength()));
+  return llvm::hash_combine(Tok.getKind(), Tok.getLength());
+}
+
+/// The Preprocessor's lexer if it's lexing a source buffer
+static Lexer* getCurrentFileLexer(Preprocessor& PP) {
+  // Token lexers (i.e. macro expansions) don't have a PreprocessorLexer
+  auto* PPL = PP.getCurrentLexer();
+  if(!PPL || PPL != PP.getCurrentFileLexer()) return nullptr;
+  auto* L = static_cast<Lexer*>(PPL);
+  if(L->isPragmaLexer()) return nullptr;
+  return L;
+}
+
+/// Create a raw lexer starting from \p Loc,
+/// which needs to be a file location
+static std::unique_ptr<Lexer> CreateRawLexer(Preprocessor& PP,
+                                             SourceLocation Loc) {
+  if(Loc.isInvalid() || !Loc.isFileID()) return nullptr;
+  auto& SM = PP.getSourceManager();
+  FileID FID;
+  unsigned Offset;
+  std::tie(FID, Offset) = SM.getDecomposedLoc(Loc);
+  bool Invalid = false;
+  auto Buffer = SM.getBufferData(FID, &Invalid);
+  if(Invalid) return nullptr;
+
+  return std::make_unique<Lexer>(SM.getLocForStartOfFile(FID),
+                                 PP.getLangOpts(),
+                                 Buffer.begin(),
+                                 Buffer.begin() + Offset,
+                                 Buffer.end());
+}
+
+bool NacroRuleParser::UseRawLexer() {
+  auto* L = getCurrentFileLexer(PP);
+  if(!L) return false;
+  auto Loc = L->getSourceLocation();
+  RawLexer = CreateRawLexer(PP, Loc);
+  if(!RawLexer) return false;
+
+  FileLexer = L;
+  RawLexedOffset = PP.getSourceManager().getFileOffset(Loc);
+  return true;
+}
+
+bool NacroRuleParser::UseRawLexer(SourceLocation Loc) {
+  RawLexer = CreateRawLexer(PP, Loc);
+  FileLexer = nullptr;
+  return bool(RawLexer);
+}
+
+void NacroRuleParser::Lex(Token& Tok) {
+  if(!RawLexer) {
+    PP.Lex(Tok);
+    Fingerprint = llvm::hash_combine(Fingerprint, HashToken(Tok));
+    return;
+  }
+
+  RawLexer->LexFromRawLexer(Tok);
+  if(Tok.is(tok::eof)) return;
+  Fingerprint = llvm::hash_combine(Fingerprint, HashToken(Tok));
+  RawLexedOffset
+    = PP.getSourceManager().getFileOffset(Tok.getLocation()) + Tok.getLength();
+  // Resolve identifiers and keywords, but nothing more
+  if(Tok.is(tok::raw_identifier))
+    PP.LookUpIdentifierInfo(Tok);
+}
+
+void NacroRuleParser::FinishRawLexing() {
+  if(!RawLexer) return;
+  if(FileLexer)
+    FileLexer->SetByteOffset(RawLexedOffset, /*StartOfLine=*/false);
+  RawLexer.reset();
+  FileLexer = nullptr;
+}
+
+SourceLocation clang::SkipNacroRule(Preprocessor& PP, size_t& Fingerprint) {
+  auto* L = getCurrentFileLexer(PP);
+  if(!L) return SourceLocation();
+  auto RawLexer = CreateRawLexer(PP, L->getSourceLocation());
+  if(!RawLexer) return SourceLocation();
+
+  // Stop right after the braces enclosing the body
+  Token Tok;
+  SourceLocation BeginLoc;
+  llvm::hash_code Hash(0);
+  unsigned BraceDepth = 0;
+  do {
+    RawLexer->LexFromRawLexer(Tok);
+    if(Tok.is(tok::eof)) return SourceLocation();
+    if(BeginLoc.isInvalid()) BeginLoc = Tok.getLocation();
+    Hash = llvm::hash_combine(Hash, HashToken(Tok));
+    if(Tok.is(tok::l_brace)) {
+      ++BraceDepth;
+    } else if(Tok.is(tok::r_brace)) {
+      if(!BraceDepth) return SourceLocation();
+      --BraceDepth;
+    }
+  } while(Tok.isNot(tok::r_brace) || BraceDepth);
+
+  auto& SM = PP.getSourceManager();
+  L->SetByteOffset(SM.getFileOffset(Tok.getEndLoc()), /*StartOfLine=*/false);
+  Fingerprint = Hash;
+  return BeginLoc;
 }
 
 bool NacroRuleParser::ParseArgList() {
@@ -30,7 +159,7 @@ bool NacroRuleParser::ParseArgList() {
   Tok.startToken();
 
   do {
-    PP.Lex(Tok);
+    Lex(Tok);
     if(Tok.isNot(tok::identifier)) {
       PP.Diag(Tok, diag::err_expected) << "an identifier";
       return false;
@@ -38,13 +167,13 @@ bool NacroRuleParser::ParseArgList() {
     auto* ArgII = Tok.getIdentifierInfo();
     assert(ArgII);
 
-    PP.Lex(Tok);
+    Lex(Tok);
     if(Tok.isNot(tok::colon)) {
       PP.Diag(Tok, diag::err_expected) << tok::colon;
       return false;
     }
 
-    PP.Lex(Tok);
+    Lex(Tok);
     if(Tok.isNot(tok::identifier)) {
       PP.Diag(Tok, diag::err_expected) << "argument type";
       return false;
@@ -58,11 +187,11 @@ bool NacroRuleParser::ParseArgList() {
     }
 
     bool isVarArgs = false;;
-    PP.Lex(Tok);
+    Lex(Tok);
     if(Tok.is(tok::star)) {
       // VARARGS
       isVarArgs = true;
-      PP.Lex(Tok);
+      Lex(Tok);
     }
 
     CurrentRule->AddReplacement(ArgII, RT, isVarArgs);
@@ -122,7 +251,7 @@ bool NacroRuleParser::ParseStr() {
   assert(CurTok.getIdentifierInfo() &&
          CurTok.getIdentifierInfo()->isStr("$str"));
 
-  PP.Lex(CurTok);
+  Lex(CurTok);
   if(CurTok.isNot(tok::l_paren)) {
     PP.Diag(CurTok, diag::err_expected) << tok::l_paren;
     return false;
@@ -130,10 +259,10 @@ bool NacroRuleParser::ParseStr() {
   // We need their Location info
   Token LParenTok = CurTok;
 
-  PP.Lex(CurTok);
+  Lex(CurTok);
   Token StrTok = CurTok;
 
-  PP.Lex(CurTok);
+  Lex(CurTok);
   if(CurTok.isNot(tok::r_paren)) {
     PP.Diag(CurTok, diag::err_expected) << tok::r_paren;
     return false;
@@ -150,14 +279,14 @@ Optional<NacroRule::Loop> NacroRuleParser::ParseLoopHeader() {
   using llvm::None;
 
   Token Tok;
-  PP.Lex(Tok);
+  Lex(Tok);
   if(Tok.isNot(tok::l_paren)) {
     PP.Diag(Tok, diag::err_expected) << tok::l_paren;
     return None;
   }
 
   // `$v in $range`
-  PP.Lex(Tok);
+  Lex(Tok);
   if(Tok.isNot(tok::identifier)) {
     PP.Diag(Tok, diag::err_expected)
       << "an identifier as the induction variable";
@@ -166,7 +295,7 @@ Optional<NacroRule::Loop> NacroRuleParser::ParseLoopHeader() {
   auto* IV = Tok.getIdentifierInfo();
   assert(IV);
 
-  PP.Lex(Tok);
+  Lex(Tok);
   if(Tok.isNot(tok::identifier) ||
      !Tok.getIdentifierInfo() ||
      !Tok.getIdentifierInfo()->isStr("in")) {
@@ -176,7 +305,7 @@ Optional<NacroRule::Loop> NacroRuleParser::ParseLoopHeader() {
 
   // TODO: For now we only support single (varargs) variable as
   // the iteration range
-  PP.Lex(Tok);
+  Lex(Tok);
   if(Tok.isNot(tok::identifier)) {
     PP.Diag(Tok, diag::err_expected)
       << "an identifier as the iteration range";
@@ -185,7 +314,7 @@ Optional<NacroRule::Loop> NacroRuleParser::ParseLoopHeader() {
   auto* IterRange = Tok.getIdentifierInfo();
   assert(IterRange);
 
-  PP.Lex(Tok);
+  Lex(Tok);
   if(Tok.isNot(tok::r_paren)) {
     PP.Diag(Tok, diag::err_expected) << tok::r_paren;
     return None;
@@ -201,9 +330,13 @@ bool NacroRuleParser::ParseLoop() {
 
   auto LH = ParseLoopHeader();
   if(!LH) return false;
+  // Loops are recorded in the order of their headers, such that
+  // nested loops have larger indices than the enclosing one
+  CurrentRule->AddLoop(*LH);
 
   // Use everything (especially the SrcLoc) from `$loop`
-  // except the token kind
+  // except the token kind. Note that the loop header is the only
+  // loop hint carrying a valid location.
   CurTok.setKind(tok::annot_pragma_loop_hint);
   CurrentRule->AddToken(CurTok);
 
@@ -216,8 +349,6 @@ bool NacroRuleParser::ParseLoop() {
   LoopEndTok.setKind(tok::annot_pragma_loop_hint);
   CurrentRule->AddToken(LoopEndTok);
 
-  CurrentRule->AddLoop(*LH);
-
   return true;
 }
 
@@ -227,32 +358,25 @@ void NacroRuleParser::WrapNacroBody() {
   switch(CurrentRule->getGeneratedType()) {
   case NacroRule::ReplacementTy::Expr: {
     // replace with parens
-    Token FirstTok = CurrentRule->getToken(0),
-          LastTok = CurrentRule->token_back();
-    FirstTok.setKind(tok::l_paren);
-    LastTok.setKind(tok::r_paren);
-
-    auto Head = CurrentRule->erase_token(CurrentRule->token_begin());
-    CurrentRule->insert_token(Head, FirstTok);
-    auto Tail = CurrentRule->insert_token(CurrentRule->token_end(),
-                                          LastTok);
-    CurrentRule->erase_token(--Tail);
+    CurrentRule->token_begin()->setKind(tok::l_paren);
+    std::prev(CurrentRule->token_end())->setKind(tok::r_paren);
     break;
   }
   case NacroRule::ReplacementTy::Stmt: {
     // remove any enclosement and add semi-colon at the end
     // if there hasn't any
-    CurrentRule->erase_token(CurrentRule->token_begin());
-
+    auto NumTokens = CurrentRule->token_size();
+    assert(NumTokens >= 2);
     auto LastTok = CurrentRule->token_back();
-    LastTok.setKind(tok::semi);
-    auto Tail = CurrentRule->insert_token(CurrentRule->token_end(),
-                                          LastTok);
-    Tail = CurrentRule->erase_token(--Tail);
-    if((--Tail)->is(tok::semi)) {
-      // has duplicate, remove the last one
-      CurrentRule->erase_token(++Tail);
+    llvm::SmallVector<Token, 16> NewTokens;
+    NewTokens.reserve(NumTokens - 1);
+    NewTokens.append(std::next(CurrentRule->token_begin()),
+                     std::prev(CurrentRule->token_end()));
+    if(NewTokens.empty() || NewTokens.back().isNot(tok::semi)) {
+      LastTok.setKind(tok::semi);
+      NewTokens.push_back(LastTok);
     }
+    CurrentRule->swapTokens(NewTokens);
     break;
   }
   case NacroRule::ReplacementTy::Block:
@@ -263,12 +387,17 @@ void NacroRuleParser::WrapNacroBody() {
 
 bool NacroRuleParser::Parse() {
   if(HasEncounteredError) return false;
+  llvm::TimeTraceScope TimeScope("NacroParseRule",
+                                 CurrentRule->getNameStr());
+  // Whether it succeeded or not, the Preprocessor
+  // should resume from where we stopped
+  auto SyncLexer = llvm::make_scope_exit([this] { FinishRawLexing(); });
 
   Token Tok;
   Tok.startToken();
 
   // '('
-  PP.Lex(Tok);
+  Lex(Tok);
   if(Tok.isNot(tok::l_paren)) {
     PP.Diag(Tok, diag::err_expected) << tok::l_paren;
     return false;
@@ -280,7 +409,7 @@ bool NacroRuleParser::Parse() {
   if(!ParseArgList()) return false;
 
   // '->'
-  PP.Lex(Tok);
+  Lex(Tok);
   if(Tok.isNot(tok::arrow)) {
     PP.Diag(Tok, diag::err_expected) << tok::arrow;
     return false;
@@ -1,15 +1,20 @@
 #ifndef NACRO_NACRO_PARSERS_H
 #define NACRO_NACRO_PARSERS_H
 #include "clang/Basic/TokenKinds.h"
+#include "clang/Lex/Lexer.h"
 #include "clang/Lex/Preprocessor.h"
 
 #include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/Hashing.h"
 #include "llvm/ADT/Optional.h"
 #include "llvm/ADT/StringRef.h"
 #include "NacroRule.h"
 #include <memory>
 
 namespace clang {
+// Forward Declarations
+class NacroContext;
+
 class NacroParser {
 protected:
   /// #pragma nacro <category> [pragma params...]
@@ -34,20 +39,56 @@ public:
 };
 
 class NacroRuleParser : public NacroParser {
+  NacroContext& Ctx;
+
   NacroRule* CurrentRule;
 
   Token CurTok;
 
+  /// If non-null, tokens are read from this raw lexer
+  /// instead of the Preprocessor
+  std::unique_ptr<Lexer> RawLexer;
+  /// The Preprocessor's lexer RawLexer is reading on behalf of
+  Lexer* FileLexer;
+  /// End offset of the last token read by RawLexer
+  unsigned RawLexedOffset;
+
+  /// Hash of the tokens read so far
+  llvm::hash_code Fingerprint;
+
+  /// Sync FileLexer with RawLexer so that the Preprocessor
+  /// continues after the last token we read
+  void FinishRawLexing();
+
   void WrapNacroBody();
 
 public:
+  NacroRuleParser(NacroContext& Ctx, llvm::ArrayRef<Token> Params);
+  /// Look up the NacroContext of \p PP, prefer the other
+  /// constructor if the context is at hand
   NacroRuleParser(Preprocessor& PP, llvm::ArrayRef<Token> Params);
 
   inline
   NacroRule* getNacroRule() { return CurrentRule; }
 
+  /// Read the rule from the current source buffer with a raw
+  /// lexer. So no macro expansion or PPCallbacks would happen.
+  /// Return false if it's not possible (e.g. within a _Pragma),
+  /// in which case the Preprocessor is used as usual.
+  bool UseRawLexer();
+  /// Read the rule starting from \p Loc with a raw lexer.
+  /// The Preprocessor is left untouched.
+  bool UseRawLexer(SourceLocation Loc);
+
+  void Lex(Token& Tok);
+
+  /// Hash of the kinds and spellings of every token in the rule
+  /// (excluding the pragma line). Note that the token locations
+  /// are not taken into account.
+  size_t getFingerprint() const { return Fingerprint; }
+
   inline void Advance() {
-    PP.Lex(CurTok);
+    Lex(CurTok);
   }
 
   bool ParseArgList();
@@ -61,5 +102,13 @@ public:
 
   bool Parse() override;
 };
+
+/// Skip a rule definition (i.e. everything until the braces enclosing
+/// its body are closed) from the current source buffer without parsing
+/// it. Return the location where the rule starts, or an invalid one if
+/// the rule can't be skipped, in which case nothing is consumed.
+/// \p Fingerprint is identical to NacroRuleParser::getFingerprint
+/// of the same rule read by a raw lexer.
+SourceLocation SkipNacroRule(Preprocessor& PP, size_t& Fingerprint);
 } // end namespace clang
 #endif
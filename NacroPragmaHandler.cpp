@@ -5,6 +5,7 @@
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include "NacroContext.h"
 #include "NacroParsers.h"
 #include "NacroExpanders.h"
 #include "NacroVerifier.h"
@@ -27,7 +28,7 @@ void NacroPragmaHandler::HandlePragma(Preprocessor &PP,
   Tok.startToken();
 
   // Decide the category
-  // (Currently we have only one category: rule)
+  // (rule, undef, push or pop)
   StringRef Category;
   SmallVector<Token, 1> PragmaArgs;
   PP.Lex(Tok);
@@ -44,16 +45,67 @@ void NacroPragmaHandler::HandlePragma(Preprocessor &PP,
   } while(Tok.isNot(tok::eod));
 
   if(Category == "rule") {
-    NacroRuleParser Parser(PP, PragmaArgs);
-    if(!Parser.Parse()) return;
+    auto& Ctx = NacroContext::Get(PP);
+    const auto& Options = Ctx.getOptions();
+    const auto& NameTok = PragmaArgs.front();
+    if(Options.LazyRules && NameTok.is(tok::identifier)) {
+      // Don't parse the rule until it's used
+      size_t Fingerprint;
+      auto BeginLoc = SkipNacroRule(PP, Fingerprint);
+      if(BeginLoc.isValid()) {
+        if(!Ctx.isDuplicatedRule(NameTok, Fingerprint, BeginLoc))
+          Ctx.AddLazyRule(NameTok, BeginLoc, Fingerprint);
+        return;
+      }
+    }
+
+    NacroRuleParser Parser(Ctx, PragmaArgs);
     auto* Rule = Parser.getNacroRule();
+    if(Options.RawLexing)
+      Parser.UseRawLexer();
+    if(!Parser.Parse() ||
+       Ctx.isDuplicatedRule(NameTok, Parser.getFingerprint(),
+                            Rule->getBeginLoc())) {
+      // Never exported
+      Ctx.DestroyRule(Rule);
+      return;
+    }
 
-    NacroRuleExpander Expander(Rule, PP);
+    NacroRuleExpander Expander(Rule, Ctx);
     if(Expander.Expand()) return;
 
-    // FIXME: Make AddNacroRule completely static
-    NacroVerifier(PP.getSourceManager())
-      .AddNacroRule(Expander.getNacroRule());
+    NacroVerifier(Ctx).AddNacroRule(Expander.getNacroRule());
+    Ctx.AddDefinedRule(Rule->getName(), Parser.getFingerprint(),
+                       Rule->getBeginLoc(), Rule);
+  } else if(Category == "undef" ||
+            Category == "push" || Category == "pop") {
+    auto& Ctx = NacroContext::Get(PP);
+    auto& Diag = PP.getDiagnostics();
+    for(const auto& NameTok : PragmaArgs) {
+      if(NameTok.is(tok::eod)) break;
+      if(NameTok.isNot(tok::identifier)) {
+        PP.Diag(NameTok, diag::err_expected) << "rule name identifier";
+        return;
+      }
+
+      if(Category == "push") {
+        Ctx.PushRule(NameTok);
+      } else if(Category == "pop") {
+        if(!Ctx.PopRule(NameTok)) {
+          auto DiagID
+            = Diag.getCustomDiagID(DiagnosticsEngine::Warning,
+                                   "could not pop '%0', no matching "
+                                   "'#pragma nacro push'");
+          Diag.Report(NameTok.getLocation(), DiagID)
+            << NameTok.getIdentifierInfo()->getName();
+        }
+      } else if(!Ctx.UndefRule(NameTok)) {
+        auto DiagID = Diag.getCustomDiagID(DiagnosticsEngine::Warning,
+                                           "'%0' is not a nacro rule");
+        Diag.Report(NameTok.getLocation(), DiagID)
+          << NameTok.getIdentifierInfo()->getName();
+      }
+    }
   } else {
     llvm::errs() << "Unrecognized category: "
                  << Category << "\n";
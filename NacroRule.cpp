@@ -1,21 +1,13 @@
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/StringSwitch.h"
 #include "clang/Basic/IdentifierTable.h"
 #include "NacroRule.h"
-#include <memory>
-#include <vector>
 
 using namespace clang;
 
 using llvm::StringRef;
 using llvm::ArrayRef;
 
-static std::vector<std::unique_ptr<NacroRule>> NacroRulesOwner;
-
-NacroRule* NacroRule::Create(IdentifierInfo* NameII) {
-  NacroRulesOwner.emplace_back(new NacroRule(NameII));
-  return NacroRulesOwner.back().get();
-}
-
 NacroRule::ReplacementTy NacroRule::GetReplacementTy(StringRef RawType) {
   return llvm::StringSwitch<ReplacementTy>(RawType)
           .Case("$expr", ReplacementTy::Expr)
@@ -30,6 +22,107 @@ void NacroRule::AddReplacement(IdentifierInfo* II, ReplacementTy Ty,
 }
 
 bool NacroRule::needsPPHooks() const {
-  // For now only loops need PPCallbacks
-  return !loop_empty();
+  // Loops and renaming local declarations
+  // can't be done by normal macros
+  return !loop_empty() || !local_empty();
+}
+
+void NacroRule::BuildTemplate() {
+  Template.clear();
+
+  auto getParamIndex = [this](const Token& Tok) -> int {
+    if(Tok.isNot(tok::identifier)) return -1;
+    for(int I = 0, E = Replacements.size(); I < E; ++I) {
+      if(Replacements[I].Identifier == Tok.getIdentifierInfo())
+        return I;
+    }
+    return -1;
+  };
+
+  // Slot indices and loop indices of the enclosing loops
+  llvm::SmallVector<std::pair<unsigned, unsigned>, 2> LoopStack;
+  auto getLoopIndex = [&](const Token& Tok) -> int {
+    if(Tok.isNot(tok::identifier)) return -1;
+    // Innermost loop first
+    for(const auto& LS : llvm::reverse(LoopStack)) {
+      if(Loops[LS.second].InductionVar == Tok.getIdentifierInfo())
+        return LS.second;
+    }
+    return -1;
+  };
+
+  auto getLocalIndex = [this](unsigned TokIdx) -> int {
+    const auto& Tok = Tokens[TokIdx];
+    if(Tok.isNot(tok::identifier)) return -1;
+    // Member names are not declared by us
+    if(TokIdx > 0 && Tokens[TokIdx - 1].isOneOf(tok::period, tok::arrow))
+      return -1;
+    auto It = llvm::find(Locals, Tok.getIdentifierInfo());
+    if(It == Locals.end()) return -1;
+    return It - Locals.begin();
+  };
+
+  unsigned LiteralBegin = 0, NextLoopIdx = 0;
+  auto addSlot = [&](unsigned TokIdx, TemplateSlot Slot) {
+    if(LiteralBegin < TokIdx)
+      Template.push_back({TemplateSlot::Literal, LiteralBegin, TokIdx,
+                          SourceLocation(), SourceLocation()});
+    Template.push_back(Slot);
+  };
+
+  for(unsigned I = 0, E = Tokens.size(); I < E; ++I) {
+    const auto& Tok = Tokens[I];
+    auto Loc = Tok.getLocation();
+    if(Tok.is(tok::annot_pragma_loop_hint)) {
+      // Only the loop header carries a valid location
+      if(Loc.isValid()) {
+        assert(NextLoopIdx < Loops.size() && "Loop out-of-bound?");
+        addSlot(I, {TemplateSlot::Loop, NextLoopIdx, 0, Loc, Loc});
+        LoopStack.push_back({Template.size() - 1, NextLoopIdx++});
+      } else {
+        assert(!LoopStack.empty() && "Unbalanced loop?");
+        unsigned SlotIdx = LoopStack.pop_back_val().first;
+        if(LiteralBegin < I)
+          Template.push_back({TemplateSlot::Literal, LiteralBegin, I,
+                              SourceLocation(), SourceLocation()});
+        Template[SlotIdx].End = Template.size();
+      }
+      LiteralBegin = I + 1;
+      continue;
+    }
+
+    if(Tok.is(tok::hash) && I + 1 < E) {
+      const auto& NextTok = Tokens[I + 1];
+      int Idx;
+      if((Idx = getLoopIndex(NextTok)) >= 0) {
+        addSlot(I, {TemplateSlot::StrLoopVar, unsigned(Idx), 0,
+                    NextTok.getLocation(), Loc});
+      } else if((Idx = getParamIndex(NextTok)) >= 0) {
+        addSlot(I, {TemplateSlot::StrParam, unsigned(Idx), 0,
+                    NextTok.getLocation(), Loc});
+      } else {
+        continue;
+      }
+      LiteralBegin = ++I + 1;
+      continue;
+    }
+
+    int Idx;
+    if((Idx = getLoopIndex(Tok)) >= 0) {
+      addSlot(I, {TemplateSlot::LoopVar, unsigned(Idx), 0, Loc, Loc});
+      LiteralBegin = I + 1;
+    } else if((Idx = getParamIndex(Tok)) >= 0) {
+      addSlot(I, {TemplateSlot::Param, unsigned(Idx), 0, Loc, Loc});
+      LiteralBegin = I + 1;
+    } else if((Idx = getLocalIndex(I)) >= 0) {
+      addSlot(I, {TemplateSlot::Local, unsigned(Idx), I, Loc, Loc});
+      LiteralBegin = I + 1;
+    }
+  }
+  assert(LoopStack.empty() && "Unbalanced loop?");
+
+  if(LiteralBegin < Tokens.size())
+    Template.push_back({TemplateSlot::Literal, LiteralBegin,
+                        unsigned(Tokens.size()),
+                        SourceLocation(), SourceLocation()});
 }
@@ -11,6 +11,7 @@
 namespace clang {
 // Forward Declarations
 class IdentifierInfo;
+class NacroContext;
 
 struct NacroRule {
   enum class ReplacementTy {
@@ -49,9 +50,42 @@ struct NacroRule {
     }
   };
 
+  /// A piece of the precomputed expansion template. Expanding a rule
+  /// is simply walking through these slots, no need to look at every
+  /// tokens in the rule body.
+  struct TemplateSlot {
+    enum SlotKind : uint8_t {
+      /// Tokens in range [Begin, End) of the rule body
+      Literal,
+      /// The (pre-expanded) actual argument of parameter #Begin
+      Param,
+      /// The stringified actual argument of parameter #Begin
+      StrParam,
+      /// Current element of loop #Begin
+      LoopVar,
+      /// Stringified current element of loop #Begin
+      StrLoopVar,
+      /// Loop #Begin, whose body are the slots within (this slot, End)
+      Loop,
+      /// Local declaration #Begin, which is token #End in the rule body.
+      /// It's renamed on every expansion
+      Local
+    };
+    SlotKind Kind;
+    unsigned Begin, End;
+    /// Location of the replaced identifier and the preceding
+    /// hash (if it's stringified)
+    SourceLocation Loc, HashLoc;
+  };
+
   /// null if name is not set
   IdentifierInfo* getName() const { return Name; }
 
+  /// Printable name, for traces for instance
+  llvm::StringRef getNameStr() const {
+    return Name? Name->getName() : "<anonymous>";
+  }
+
   ReplacementTy getGeneratedType() const { return GeneratedType; }
   void setGeneratedType(ReplacementTy RT) {
     GeneratedType = RT;
@@ -86,12 +120,20 @@ private:
 
   llvm::SmallVector<Loop, 2> Loops;
 
+  /// Identifiers declared within the rule body,
+  /// only collected in hygiene mode
+  llvm::SmallVector<IdentifierInfo*, 2> Locals;
+
+  llvm::SmallVector<TemplateSlot, 8> Template;
+
   NacroRule(IdentifierInfo* NameII)
     : Name(NameII), SrcRange(),
       GeneratedType(ReplacementTy::Block) {}
 
+  // Rules can only be created by NacroContext::CreateRule
+  friend class NacroContext;
+
 public:
-  static NacroRule* Create(IdentifierInfo* NameII);
 
   using repl_iterator
     = typename decltype(Replacements)::iterator;
@@ -163,12 +205,10 @@ public:
     return Tokens[i];
   }
 
-  token_iterator insert_token(token_iterator pos, const Token& tok) {
-    return Tokens.insert(pos, tok);
-  }
-
-  token_iterator erase_token(token_iterator pos) {
-    return Tokens.erase(pos);
+  /// Replace the entire body with \p NewTokens.
+  /// (\p NewTokens will contain the old body afterward)
+  void swapTokens(llvm::SmallVectorImpl<Token>& NewTokens) {
+    Tokens.swap(NewTokens);
   }
 
   inline void AddLoop(const Loop& LP) {
@@ -198,6 +238,12 @@ public:
     return Loops.empty();
   }
 
+  size_t loop_size() const { return Loops.size(); }
+
+  auto loops() const {
+    return llvm::make_range(loop_begin(), loop_end());
+  }
+
   inline
   Loop& getLoop(size_t Idx) {
     return Loops[Idx];
@@ -207,8 +253,30 @@ public:
     return Loops[Idx];
   }
 
+  void AddLocal(IdentifierInfo* II) {
+    if(!llvm::is_contained(Locals, II))
+      Locals.push_back(II);
+  }
+
+  bool local_empty() const { return Locals.empty(); }
+
+  size_t local_size() const { return Locals.size(); }
+
+  IdentifierInfo* getLocal(size_t Idx) const {
+    assert(Idx < Locals.size());
+    return Locals[Idx];
+  }
+
   /// Require installing PPCallbacks (e.g. loops)
   bool needsPPHooks() const;
+
+  /// Lower the rule body into expansion template.
+  /// Need to be called again if the body is modified
+  void BuildTemplate();
+
+  llvm::ArrayRef<TemplateSlot> getTemplate() const {
+    return Template;
+  }
 };
 } // end namespace clang
 #endif
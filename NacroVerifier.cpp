@@ -1,98 +1,101 @@
 #include "clang/AST/ASTConsumer.h"
+#include "clang/AST/DeclGroup.h"
 #include "clang/AST/Expr.h"
 #include "clang/Basic/Diagnostic.h"
 #include "clang/AST/RecursiveASTVisitor.h"
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/Frontend/FrontendAction.h"
 #include "clang/Frontend/FrontendPluginRegistry.h"
-#include "llvm/ADT/IntervalMap.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/TimeProfiler.h"
 #include "llvm/Support/raw_ostream.h"
+#include "NacroContext.h"
 #include "NacroVerifier.h"
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
 #include <vector>
 
 using namespace clang;
 
-namespace llvm {
-template<>
-struct IntervalMapHalfOpenInfo<FullSourceLoc> {
-  static inline bool isUnfairComparison(const FullSourceLoc& LHS,
-                                        const FullSourceLoc& RHS) {
-    return (!LHS.hasManager() || !RHS.hasManager()) ||
-           (&LHS.getManager() != &RHS.getManager());
-  }
-
-  /// startLess - Return true if x is not in [a;b).
-  static inline
-  bool startLess(const FullSourceLoc &x, const FullSourceLoc &a) {
-    if(isUnfairComparison(x, a)) {
-      return x.getRawEncoding() < a.getRawEncoding();
-    } else {
-      auto& SM = x.getManager();
-      return SM.isBeforeInTranslationUnit(cast<const SourceLocation>(x),
-                                          cast<const SourceLocation>(a));
-    }
-  }
-
-  /// stopLess - Return true if x is not in [a;b).
-  static inline
-  bool stopLess(const FullSourceLoc &b, const FullSourceLoc &x) {
-    if(isUnfairComparison(b, x)) {
-      return b.getRawEncoding() <= x.getRawEncoding();
-    } else {
-      auto& SM = x.getManager();
-      return SM.isBeforeInTranslationUnit(cast<const SourceLocation>(b),
-                                          cast<const SourceLocation>(x)) ||
-             b == x;
-    }
-  }
+void NacroRuleDepot::insert(SourceLocation B, SourceLocation E,
+                            NacroRule* Rule, const SourceManager& SM) {
+  FileID FID;
+  unsigned BeginOffset;
+  std::tie(FID, BeginOffset) = SM.getDecomposedLoc(B);
+  auto EndDecomp = SM.getDecomposedLoc(E);
+  // Rules are never splitted across files, but just in case
+  unsigned EndOffset = EndDecomp.first == FID? EndDecomp.second
+                                             : SM.getFileIDSize(FID);
+  if(EndOffset <= BeginOffset) return;
 
-  /// adjacent - Return true when the intervals [x;a) and [b;y) can coalesce.
-  static inline
-  bool adjacent(const FullSourceLoc &a, const FullSourceLoc &b) {
-    return a == b;
-  }
+  auto& FileIntervals = Intervals[FID];
+  // Rules are usually defined in order
+  auto It = FileIntervals.end();
+  if(!FileIntervals.empty() && FileIntervals.back().Begin > BeginOffset)
+    It = llvm::partition_point(FileIntervals,
+                               [=](const Interval& I) {
+                                 return I.Begin < BeginOffset;
+                               });
+  FileIntervals.insert(It, {BeginOffset, EndOffset, Rule});
+  ++NumIntervals;
+}
 
-  /// nonEmpty - Return true if [a;b) is non-empty.
-  static inline
-  bool nonEmpty(const FullSourceLoc &a, const FullSourceLoc &b) {
-    if(isUnfairComparison(a, b)) {
-      return a.getRawEncoding() < b.getRawEncoding();
-    } else {
-      auto& SM = a.getManager();
-      return SM.isBeforeInTranslationUnit(cast<const SourceLocation>(a),
-                                          cast<const SourceLocation>(b));
-    }
+void NacroRuleDepot::erase(SourceLocation B, NacroRule* Rule,
+                           const SourceManager& SM) {
+  FileID FID;
+  unsigned Offset;
+  std::tie(FID, Offset) = SM.getDecomposedLoc(B);
+  auto FI = Intervals.find(FID);
+  if(FI == Intervals.end()) return;
+  auto& FileIntervals = FI->second;
+  auto It = llvm::partition_point(FileIntervals,
+                                  [=](const Interval& I) {
+                                    return I.Begin < Offset;
+                                  });
+  if(It != FileIntervals.end() && It->Begin == Offset && It->Rule == Rule) {
+    FileIntervals.erase(It);
+    --NumIntervals;
   }
-};
-} // end namespace clang
+}
 
-namespace {
-struct NacroRuleDepot {
-  using IntervalTy
-    = llvm::IntervalMap<FullSourceLoc, NacroRule*,
-          llvm::IntervalMapImpl::NodeSizer<FullSourceLoc, NacroRule*>::LeafSize,
-          llvm::IntervalMapHalfOpenInfo<FullSourceLoc>>;
-  typename IntervalTy::Allocator Allocator;
-  IntervalTy Intervals;
-
-  NacroRuleDepot()
-    : Allocator(),
-      Intervals(Allocator) {}
-
-  inline
-  operator bool() const {
-    return !Intervals.empty();
-  }
-};
-} // end anonymous namespace
+NacroRule* NacroRuleDepot::lookup(SourceLocation Loc,
+                                  const SourceManager& SM) const {
+  if(Loc.isInvalid()) return nullptr;
+  FileID FID;
+  unsigned Offset;
+  std::tie(FID, Offset) = SM.getDecomposedLoc(Loc);
+  auto FI = Intervals.find(FID);
+  if(FI == Intervals.end()) return nullptr;
+  const auto& FileIntervals = FI->second;
+  // The last interval that begins at or before Offset
+  auto It = llvm::partition_point(FileIntervals,
+                                  [=](const Interval& I) {
+                                    return I.Begin <= Offset;
+                                  });
+  if(It == FileIntervals.begin()) return nullptr;
+  --It;
+  return Offset < It->End? It->Rule : nullptr;
+}
 
-static NacroRuleDepot NacroRules;
+NacroVerifier::NacroVerifier(NacroContext& Ctx)
+  : Depot(Ctx.getRuleDepot()),
+    SM(Ctx.getPreprocessor().getSourceManager()) {}
 
 void NacroVerifier::AddNacroRule(NacroRule* Rule) {
   auto SR = Rule->getSourceRange();
-  auto B = SR.getBegin(), E = SR.getEnd();
-  NacroRules.Intervals.insert(FullSourceLoc(B, SM), FullSourceLoc(E, SM),
-                              Rule);
+  Depot.insert(SR.getBegin(), SR.getEnd(), Rule, SM);
+}
+
+void NacroVerifier::RemoveNacroRule(NacroRule* Rule) {
+  Depot.erase(Rule->getBeginLoc(), Rule, SM);
 }
 
 namespace {
@@ -108,10 +111,15 @@ namespace {
 /// ```
 struct NacroDeclRefChecker
   : public RecursiveASTVisitor<NacroDeclRefChecker> {
-  explicit NacroDeclRefChecker(ASTContext& Context)
+  /// \p SMLock should be given if multiple checkers run concurrently.
+  /// SourceManager updates its internal caches even on queries.
+  NacroDeclRefChecker(ASTContext& Context, const NacroRuleDepot& Depot,
+                      std::mutex* SMLock = nullptr)
     : Ctx(Context),
+      NacroRules(Depot),
       SM(Ctx.getSourceManager()),
-      Diag(Ctx.getDiagnostics()) {
+      Diag(Ctx.getDiagnostics()),
+      SMLock(SMLock) {
     ErrDiagID = Diag.getCustomDiagID(DiagnosticsEngine::Error,
                                      "a potential declaration leak detected");
     RefNoteDiagID = Diag.getCustomDiagID(DiagnosticsEngine::Note,
@@ -125,62 +133,269 @@ struct NacroDeclRefChecker
   bool VisitDeclRefExpr(DeclRefExpr* DRE) {
     if(!NacroRules) return true;
 
-    auto DRELoc
-      = FullSourceLoc(SM.getSpellingLoc(DRE->getLocation()), SM);
+    // Throw an error if the referenced declaration is in
+    // a nacro but the reference is not (or in another nacro)
     auto* D = DRE->getDecl();
-    auto DLoc
-      = FullSourceLoc(SM.getSpellingLoc(D->getLocation()), SM);
-    // Throw an error if one of DRELoc or DLoc is in
-    // a nacro but the other is not
-    auto* RefR = NacroRules.Intervals.lookup(DRELoc);
-    auto* DeclR = NacroRules.Intervals.lookup(DLoc);
-    if(RefR != DeclR &&
-       DeclR != nullptr) {
-      Diag.Report(DRE->getLocation(), ErrDiagID);
-      Diag.Report(DRE->getLocation(), RefNoteDiagID)
-        << DRE->getNameInfo().getName().getAsString();
-      Diag.Report(DLoc, DeclNoteDiagID);
-    }
+    auto* DeclR = getOwningRule(D);
+    if(!DeclR) return true;
+    auto Lock = lockSM();
+    auto DRELoc = getSpellingLoc(DRE->getLocation());
+    auto* RefR = NacroRules.lookup(DRELoc, SM);
+    if(RefR != DeclR)
+      Leaks.push_back({DRE->getLocation(),
+                       getSpellingLoc(D->getLocation()),
+                       DRE->getNameInfo().getName().getAsString()});
     return true;
   }
 
+  /// Report the leaks found so far in the order they're visited
+  void EmitLeaks() {
+    for(const auto& L : Leaks) {
+      Diag.Report(L.RefLoc, ErrDiagID);
+      Diag.Report(L.RefLoc, RefNoteDiagID) << L.Name;
+      Diag.Report(L.DeclLoc, DeclNoteDiagID);
+    }
+    Leaks.clear();
+  }
+
+  void MergeStats(const NacroDeclRefChecker& Other) {
+    NumDeclCacheHits += Other.NumDeclCacheHits;
+    NumDeclCacheMisses += Other.NumDeclCacheMisses;
+    NumSpellingCacheHits += Other.NumSpellingCacheHits;
+    NumSpellingCacheMisses += Other.NumSpellingCacheMisses;
+  }
+
+  void PrintStats(llvm::raw_ostream& OS) const {
+    OS << "Verifier cache: "
+       << NumDeclCacheHits << " declaration hits, "
+       << NumDeclCacheMisses << " misses; "
+       << NumSpellingCacheHits << " spelling location hits, "
+       << NumSpellingCacheMisses << " misses.\n";
+  }
+
 private:
   ASTContext& Ctx;
+  const NacroRuleDepot& NacroRules;
   SourceManager& SM;
   DiagnosticsEngine& Diag;
 
   unsigned ErrDiagID;
   unsigned RefNoteDiagID,
            DeclNoteDiagID;
+
+  std::mutex* SMLock;
+
+  struct Leak {
+    SourceLocation RefLoc, DeclLoc;
+    std::string Name;
+  };
+  /// Diagnostics are buffered until EmitLeaks, such that
+  /// they're still in order when checkers run concurrently
+  std::vector<Leak> Leaks;
+
+  /// The rule every visited declaration is in (or null if
+  /// it's not in any rule). Most references point to a
+  /// small set of declarations.
+  llvm::DenseMap<const Decl*, NacroRule*> DeclRules;
+
+  /// Spelling locations of macro locations, indexed by their
+  /// raw encodings. Template instantiations share locations
+  /// with their patterns, for instance.
+  llvm::DenseMap<unsigned, SourceLocation> SpellingLocs;
+
+  unsigned NumDeclCacheHits = 0, NumDeclCacheMisses = 0;
+  unsigned NumSpellingCacheHits = 0, NumSpellingCacheMisses = 0;
+
+  std::unique_lock<std::mutex> lockSM() {
+    if(!SMLock) return std::unique_lock<std::mutex>();
+    return std::unique_lock<std::mutex>(*SMLock);
+  }
+
+  /// Caller should hold the SourceManager lock
+  SourceLocation getSpellingLoc(SourceLocation Loc) {
+    if(Loc.isFileID()) return Loc;
+    auto Res = SpellingLocs.try_emplace(Loc.getRawEncoding());
+    if(!Res.second) {
+      ++NumSpellingCacheHits;
+      return Res.first->second;
+    }
+    ++NumSpellingCacheMisses;
+    return Res.first->second = SM.getSpellingLoc(Loc);
+  }
+
+  NacroRule* getOwningRule(const Decl* D) {
+    auto It = DeclRules.find(D);
+    if(It != DeclRules.end()) {
+      ++NumDeclCacheHits;
+      return It->second;
+    }
+    ++NumDeclCacheMisses;
+    auto Lock = lockSM();
+    auto* Rule = NacroRules.lookup(getSpellingLoc(D->getLocation()), SM);
+    DeclRules.insert({D, Rule});
+    return Rule;
+  }
 };
 
 struct NacroVerifierImpl : public ASTConsumer {
-  explicit NacroVerifierImpl(ASTContext& Ctx)
-    : DeclRefChecker(Ctx) {}
+  NacroVerifierImpl(ASTContext& Ctx, NacroContext& NacroCtx)
+    : DeclRefChecker(Ctx, NacroCtx.getRuleDepot()),
+      NacroCtx(NacroCtx),
+      NumTopLevelDecls(0), NumVisitedDecls(0),
+      VerifierTime(0) {}
+
+  /// Check declarations as soon as they're parsed, such that
+  /// the checking overlaps with parsing and they're still hot
+  bool HandleTopLevelDecl(DeclGroupRef DG) override {
+    // Locals in rules can't be captured by construction
+    if(NacroCtx.getOptions().Hygiene) return true;
+    TimeScope Timing(VerifierTime);
+    for(auto* D : DG) {
+      ++NumTopLevelDecls;
+      // A capture only happens around the invocation, so
+      // skip declarations that don't invoke any rule
+      if(!NacroCtx.getRuleDepot() ||
+         !NacroCtx.hasInvocationIn(D->getSourceRange()))
+        continue;
+      ++NumVisitedDecls;
+      if(NacroCtx.getOptions().VerifierThreads > 1) {
+        PendingDecls.push_back(D);
+      } else {
+        llvm::TimeTraceScope TimeScope("NacroVerifyDecl",
+                                       [D] { return getDeclName(D); });
+        DeclRefChecker.TraverseDecl(D);
+      }
+    }
+    DeclRefChecker.EmitLeaks();
+    return true;
+  }
 
   void HandleTranslationUnit(ASTContext& Ctx) override {
-    DeclRefChecker.TraverseAST(Ctx);
+    if(PendingDecls.empty()) return;
+    TimeScope Timing(VerifierTime);
+    // Declarations might be lazily deserialized from the external
+    // source, which is not thread-safe
+    if(PendingDecls.size() > 1 && !Ctx.getExternalSource()) {
+      // Time profiler can only be used on the main thread
+      llvm::TimeTraceScope TimeScope("NacroVerifyParallel",
+                                     llvm::utostr(PendingDecls.size()));
+      VerifyInParallel(Ctx, PendingDecls,
+                       NacroCtx.getOptions().VerifierThreads);
+      return;
+    }
+
+    for(auto* D : PendingDecls) {
+      llvm::TimeTraceScope TimeScope("NacroVerifyDecl",
+                                     [D] { return getDeclName(D); });
+      DeclRefChecker.TraverseDecl(D);
+    }
+    DeclRefChecker.EmitLeaks();
+  }
+
+  /// Triggered by `-print-stats`
+  void PrintStats() override {
+    NacroCtx.PrintStats(llvm::errs());
+    DeclRefChecker.PrintStats(llvm::errs());
+    llvm::errs() << "Verifier: " << NumVisitedDecls << " of "
+                 << NumTopLevelDecls << " top-level declarations visited.\n";
+    llvm::errs() << llvm::format("Verifier time: %.3f ms\n",
+                                 VerifierTime.count() * 1000.0);
   }
 
 private:
   NacroDeclRefChecker DeclRefChecker;
+
+  NacroContext& NacroCtx;
+
+  unsigned NumTopLevelDecls, NumVisitedDecls;
+
+  /// Wall time spent on checking
+  std::chrono::duration<double> VerifierTime;
+
+  /// Accumulate the wall time of its scope into Total
+  struct TimeScope {
+    explicit TimeScope(std::chrono::duration<double>& Total)
+      : Total(Total), Begin(std::chrono::steady_clock::now()) {}
+    ~TimeScope() { Total += std::chrono::steady_clock::now() - Begin; }
+
+  private:
+    std::chrono::duration<double>& Total;
+    std::chrono::steady_clock::time_point Begin;
+  };
+
+  /// Declarations to be checked at the end of the translation
+  /// unit in parallel, in the order they're parsed
+  std::vector<Decl*> PendingDecls;
+
+  /// Name of \p D in traces
+  static std::string getDeclName(const Decl* D) {
+    if(const auto* ND = dyn_cast<NamedDecl>(D))
+      return ND->getQualifiedNameAsString();
+    return "<unnamed>";
+  }
+
+  /// Split \p Decls into chunks and check them on \p NumThreads threads.
+  /// Diagnostics are emitted in the original order afterward.
+  void VerifyInParallel(ASTContext& Ctx, llvm::ArrayRef<Decl*> Decls,
+                        unsigned NumThreads) {
+    // Some more chunks than threads to balance the workload
+    size_t NumChunks = std::min<size_t>(Decls.size(), NumThreads * 4);
+    size_t ChunkSize = (Decls.size() + NumChunks - 1) / NumChunks;
+
+    std::mutex SMLock;
+    std::vector<std::unique_ptr<NacroDeclRefChecker>> Checkers;
+    llvm::ThreadPool Pool(NumThreads);
+    for(size_t I = 0; I < Decls.size(); I += ChunkSize) {
+      auto Chunk = Decls.slice(I, std::min(ChunkSize, Decls.size() - I));
+      Checkers.emplace_back(
+        new NacroDeclRefChecker(Ctx, NacroCtx.getRuleDepot(), &SMLock));
+      auto* Checker = Checkers.back().get();
+      Pool.async([Checker, Chunk] {
+        for(auto* D : Chunk)
+          Checker->TraverseDecl(D);
+      });
+    }
+    Pool.wait();
+
+    for(auto& Checker : Checkers) {
+      Checker->EmitLeaks();
+      DeclRefChecker.MergeStats(*Checker);
+    }
+  }
 };
 
 struct NacroVerifierImplAction : public PluginASTAction {
   std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(
     clang::CompilerInstance &Compiler, llvm::StringRef InFile) override {
+    // This is called before the main file is preprocessed
+    auto& NacroCtx = NacroContext::Get(Compiler.getPreprocessor());
+    auto& Diag = Compiler.getDiagnostics();
+    for(const auto& Arg : Args)
+      NacroCtx.getOptions().Parse(Arg, Diag);
     return std::unique_ptr<clang::ASTConsumer>(
-      new NacroVerifierImpl(Compiler.getASTContext()));
+      new NacroVerifierImpl(Compiler.getASTContext(), NacroCtx));
   }
 
   bool ParseArgs(const CompilerInstance &CI,
                  const std::vector<std::string>& args) override {
+    // Only validate them here, since they'll be applied on top of
+    // the options given by `-mllvm -nacro-option`
+    NacroOptions Options;
+    for(const auto& Arg : args)
+      if(!Options.Parse(Arg, CI.getDiagnostics()))
+        return false;
+    Args = args;
     return true;
   }
 
   ActionType getActionType() override {
     return PluginASTAction::AddBeforeMainAction;
   }
+
+private:
+  /// Preprocessor hasn't been created when the arguments are parsed.
+  /// So keep them here until the NacroContext is available
+  std::vector<std::string> Args;
 };
 } // end anonymous namespace
 
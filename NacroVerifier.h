@@ -2,19 +2,59 @@
 #define NACRO_NACRO_VERIFIER_H
 #include "clang/Basic/SourceManager.h"
 #include "clang/Lex/Preprocessor.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
 #include "NacroRule.h"
 #include <memory>
 
 namespace clang {
+// Forward Declarations
+class NacroContext;
+
+/// Source ranges of the rules defined in a translation unit.
+/// Ranges are stored as sorted, non-overlapping file offsets per FileID,
+/// so a lookup is just a binary search over integers.
+struct NacroRuleDepot {
+  /// File offsets [Begin, End) of a rule
+  struct Interval {
+    unsigned Begin, End;
+    NacroRule* Rule;
+  };
+
+  void insert(SourceLocation B, SourceLocation E, NacroRule* Rule,
+              const SourceManager& SM);
+
+  /// Remove the interval starting at \p B if it belongs to \p Rule
+  void erase(SourceLocation B, NacroRule* Rule, const SourceManager& SM);
+
+  /// Find the rule containing \p Loc, which should be a file location.
+  /// Return null if there is none
+  NacroRule* lookup(SourceLocation Loc, const SourceManager& SM) const;
+
+  inline
+  operator bool() const {
+    return NumIntervals > 0;
+  }
+
+private:
+  llvm::DenseMap<FileID, llvm::SmallVector<Interval, 4>> Intervals;
+
+  unsigned NumIntervals = 0;
+};
+
 /// Only used as a frontend to receive NacroRule information
 /// (espcially line range info) from previous stages in the pipeline.
 struct NacroVerifier {
-  NacroVerifier(SourceManager& SM)
-    : SM(SM) {}
+  explicit NacroVerifier(NacroContext& Ctx);
 
   void AddNacroRule(NacroRule* Rule);
 
+  /// Remove the rule that has never been expanded
+  void RemoveNacroRule(NacroRule* Rule);
+
 private:
+  NacroRuleDepot& Depot;
+
   SourceManager& SM;
 };
 } // end namespace clang
@@ -0,0 +1,164 @@
+#!/usr/bin/env python3
+"""Generate synthetic translation units for benchmarking nacro.
+
+Every translation unit comes in two flavors that expand to the same
+tokens: one defines its rules with `#pragma nacro rule`, the other
+with plain `#define` macros.
+"""
+import argparse
+import os
+
+
+class Config:
+    def __init__(self, rules=32, looped=0.5, body_size=4, list_length=8,
+                 invocations=256, include_depth=2, per_function=8):
+        self.rules = rules
+        # Ratio of rules with loops
+        self.looped = looped
+        # Number of statements in every rule body
+        self.body_size = body_size
+        # Number of elements passed to every looped rule
+        self.list_length = list_length
+        self.invocations = invocations
+        # Rules are spread across this many nested headers
+        self.include_depth = include_depth
+        # Number of invocations in every generated function
+        self.per_function = per_function
+
+    @property
+    def name(self):
+        return "r{}-l{}-b{}-n{}-i{}-d{}".format(
+            self.rules, int(self.looped * 100), self.body_size,
+            self.list_length, self.invocations, self.include_depth)
+
+    def is_looped(self, idx):
+        return idx < int(self.rules * self.looped)
+
+
+def nacro_rule(cfg, idx):
+    lines = ["#pragma nacro rule rule_{}".format(idx)]
+    if cfg.is_looped(idx):
+        lines.append("(xs:$expr*) -> {")
+        lines.append("  $loop(x in xs) {")
+        for s in range(cfg.body_size):
+            lines.append("    sink(x * {});".format(s + 1))
+        lines.append("  }")
+    else:
+        lines.append("(a:$expr, b:$expr) -> {")
+        for s in range(cfg.body_size):
+            lines.append("  sink(a * {} + b);".format(s + 1))
+    lines.append("}")
+    return "\n".join(lines)
+
+
+def plain_rule(cfg, idx):
+    if cfg.is_looped(idx):
+        # Like the nacro loop, wrap every element in braces. Loop
+        # variables aren't parenthesized by nacro either
+        body = "{{ {} }}".format(" ".join("sink(x * {});".format(s + 1)
+                                          for s in range(cfg.body_size)))
+        return ("#define rule_{0}_body(x) {1}\n"
+                "#define rule_{0}(...) {{ BENCH_FOREACH_{2}(rule_{0}_body, "
+                "__VA_ARGS__) }}").format(idx, body, cfg.list_length)
+    body = " ".join("sink((a) * {} + (b));".format(s + 1)
+                    for s in range(cfg.body_size))
+    return "#define rule_{0}(a, b) {{ {1} }}".format(idx, body)
+
+
+def foreach_macros(cfg):
+    """Plain macros can't loop, so unroll them up to the list length"""
+    lines = ["#define BENCH_FOREACH_1(m, x) m(x)"]
+    for n in range(2, cfg.list_length + 1):
+        lines.append("#define BENCH_FOREACH_{}(m, x, ...) m(x) "
+                     "BENCH_FOREACH_{}(m, __VA_ARGS__)".format(n, n - 1))
+    return "\n".join(lines)
+
+
+def invocation(cfg, idx, seed):
+    if cfg.is_looped(idx):
+        return "rule_{}({})".format(
+            idx, ", ".join(str(seed + e) for e in range(cfg.list_length)))
+    return "rule_{}({}, {})".format(idx, seed, seed + 1)
+
+
+def generate(cfg, out_dir, flavor):
+    """Write the translation unit and its headers into out_dir.
+    Return path to the main file"""
+    os.makedirs(out_dir, exist_ok=True)
+    make_rule = nacro_rule if flavor == "nacro" else plain_rule
+
+    depth = max(cfg.include_depth, 0)
+    files = [[] for _ in range(depth + 1)]
+    # The last file is the main file
+    for idx in range(cfg.rules):
+        files[idx % len(files)].append(make_rule(cfg, idx))
+
+    prologue = ["void sink(int);"]
+    if flavor != "nacro":
+        prologue.append(foreach_macros(cfg))
+
+    for level in range(depth):
+        guard = "BENCH_HEADER_{}_H".format(level)
+        content = ["#ifndef " + guard, "#define " + guard]
+        if level == 0:
+            content += prologue
+        if level + 1 < depth:
+            content.append('#include "header{}.h"'.format(level + 1))
+        content += files[level]
+        content.append("#endif")
+        with open(os.path.join(out_dir, "header{}.h".format(level)), "w") as f:
+            f.write("\n".join(content) + "\n")
+
+    main = ['#include "header0.h"'] if depth else list(prologue)
+    main += files[depth]
+    for func in range(0, cfg.invocations, cfg.per_function):
+        main.append("void func_{}(void) {{".format(func))
+        for inv in range(func, min(func + cfg.per_function, cfg.invocations)):
+            main.append("  " + invocation(cfg, inv % cfg.rules, inv))
+        main.append("}")
+    main_path = os.path.join(out_dir, "main.c")
+    with open(main_path, "w") as f:
+        f.write("\n".join(main) + "\n")
+    return main_path
+
+
+def add_config_args(parser):
+    defaults = Config()
+    parser.add_argument("--rules", type=int, default=defaults.rules)
+    parser.add_argument("--looped", type=float, default=defaults.looped,
+                        help="Ratio of rules with loops")
+    parser.add_argument("--body-size", type=int, default=defaults.body_size,
+                        help="Number of statements in every rule body")
+    parser.add_argument("--list-length", type=int,
+                        default=defaults.list_length,
+                        help="Number of elements passed to looped rules")
+    parser.add_argument("--invocations", type=int,
+                        default=defaults.invocations)
+    parser.add_argument("--include-depth", type=int,
+                        default=defaults.include_depth,
+                        help="Number of nested headers rules are spread on")
+    parser.add_argument("--per-function", type=int,
+                        default=defaults.per_function,
+                        help="Number of invocations in every function")
+
+
+def config_from_args(args):
+    return Config(rules=args.rules, looped=args.looped,
+                  body_size=args.body_size, list_length=args.list_length,
+                  invocations=args.invocations,
+                  include_depth=args.include_depth,
+                  per_function=args.per_function)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    add_config_args(parser)
+    parser.add_argument("--flavor", choices=["nacro", "plain"],
+                        default="nacro")
+    parser.add_argument("-o", "--output-dir", required=True)
+    args = parser.parse_args()
+    print(generate(config_from_args(args), args.output_dir, args.flavor))
+
+
+if __name__ == "__main__":
+    main()
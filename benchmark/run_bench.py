@@ -0,0 +1,164 @@
+#!/usr/bin/env python3
+"""Compare the cost of nacro rules against equivalent plain macros
+on synthetic translation units generated by gen_tu.py.
+
+For every configuration, report the wall time of preprocessing
+(`-E`), the whole frontend (`-fsyntax-only`), the time spent in the
+declaration leak verifier (nacro only) and the peak RSS.
+"""
+import argparse
+import json
+import os
+import re
+import statistics
+import subprocess
+import sys
+import time
+
+import gen_tu
+
+# Presets for --sweep. Every entry overrides the base configuration,
+# except "plugin_args", which are passed to the plugin in addition to
+# --plugin-arg
+SWEEPS = {
+    "rules": [{"rules": n} for n in (16, 64, 256, 1024)],
+    "invocations": [{"invocations": n} for n in (256, 1024, 4096, 16384)],
+    "list-length": [{"list_length": n} for n in (2, 8, 32, 128)],
+    "body-size": [{"body_size": n} for n in (1, 4, 16, 64)],
+    "looped": [{"looped": r} for r in (0.0, 0.5, 1.0)],
+    "include-depth": [{"include_depth": n} for n in (0, 4, 16, 64)],
+    # Nacro time and memory should grow linearly with the list length.
+    # The FOREACH chain of the plain flavor can't go this far
+    "large-list": [{"list_length": n, "looped": 1.0, "rules": 1,
+                    "body_size": 1, "invocations": 4, "per_function": 1}
+                   for n in (1000, 10000, 100000)],
+    # A large, invocation-heavy translation unit keeps the verifier busy
+    "verifier-threads": [{"rules": 256, "invocations": 65536,
+                          "plugin_args": ["verifier-threads={}".format(n)]}
+                         for n in (1, 2, 4, 8)],
+}
+
+# Sweeps that can only run on the nacro flavor
+NACRO_ONLY_SWEEPS = {"large-list", "verifier-threads"}
+
+VERIFIER_TIME_RE = re.compile(r"Verifier time: ([0-9.]+) ms")
+
+
+def run(cmd):
+    """Run cmd and return (wall seconds, peak RSS in KB, stderr)"""
+    begin = time.perf_counter()
+    proc = subprocess.Popen(cmd, stdout=subprocess.DEVNULL,
+                            stderr=subprocess.PIPE, universal_newlines=True)
+    # Read before waiting, otherwise a full pipe blocks the child
+    stderr = proc.stderr.read()
+    proc.stderr.close()
+    _, status, usage = os.wait4(proc.pid, 0)
+    # Already reaped
+    proc.returncode = status
+    elapsed = time.perf_counter() - begin
+    if not os.WIFEXITED(status) or os.WEXITSTATUS(status) != 0:
+        sys.stderr.write(stderr)
+        raise RuntimeError("Failed to run: " + " ".join(cmd))
+    return elapsed, usage.ru_maxrss, stderr
+
+
+def measure(args, main_path, flavor, plugin_args=()):
+    base = [args.clang, "-w"]
+    # Clang doesn't run plugin actions under -E, so plugin arguments
+    # never reach nacro there. Pass the options by -mllvm instead
+    pp_base, fe_base = list(base), list(base)
+    if flavor == "nacro":
+        load = ["-Xclang", "-load", "-Xclang", args.plugin]
+        pp_base += load
+        fe_base += load
+        for opt in args.plugin_arg + list(plugin_args):
+            pp_base += ["-mllvm", "-nacro-option=" + opt]
+            fe_base += ["-Xclang", "-plugin-arg-nacro-verifier",
+                        "-Xclang", opt]
+
+    pp_times, fe_times, verifier_times, rss = [], [], [], []
+    for _ in range(args.repeat):
+        elapsed, _, _ = run(pp_base + ["-E", "-o", os.devnull, main_path])
+        pp_times.append(elapsed)
+
+        cmd = fe_base + ["-fsyntax-only", main_path]
+        if flavor == "nacro":
+            cmd[1:1] = ["-Xclang", "-print-stats"]
+        elapsed, max_rss, stderr = run(cmd)
+        fe_times.append(elapsed)
+        rss.append(max_rss)
+        match = VERIFIER_TIME_RE.search(stderr)
+        if match:
+            verifier_times.append(float(match.group(1)) / 1000.0)
+
+    return {
+        "preprocess_ms": statistics.median(pp_times) * 1000.0,
+        "frontend_ms": statistics.median(fe_times) * 1000.0,
+        "verifier_ms": statistics.median(verifier_times) * 1000.0
+                       if verifier_times else None,
+        "peak_rss_mb": max(rss) / 1024.0,
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    gen_tu.add_config_args(parser)
+    parser.add_argument("--clang", required=True)
+    parser.add_argument("--plugin", required=True,
+                        help="Path to NacroPlugin")
+    parser.add_argument("--plugin-arg", action="append", default=[],
+                        help="Extra option passed to the plugin")
+    parser.add_argument("--work-dir", required=True,
+                        help="Where generated translation units are placed")
+    parser.add_argument("--sweep", choices=sorted(SWEEPS.keys()),
+                        help="Vary one parameter over a preset range")
+    parser.add_argument("--repeat", type=int, default=3,
+                        help="Number of runs, the median is reported")
+    parser.add_argument("--json", help="Also write the results here")
+    args = parser.parse_args()
+
+    # Pairs of the configuration and its extra plugin arguments
+    configs = [(gen_tu.config_from_args(args), [])]
+    if args.sweep:
+        configs = []
+        for overrides in SWEEPS[args.sweep]:
+            cfg = gen_tu.config_from_args(args)
+            plugin_args = []
+            for key, value in overrides.items():
+                if key == "plugin_args":
+                    plugin_args = value
+                else:
+                    setattr(cfg, key, value)
+            configs.append((cfg, plugin_args))
+    flavors = ("nacro", "plain")
+    if args.sweep in NACRO_ONLY_SWEEPS:
+        flavors = ("nacro",)
+
+    header = "{:<48} {:<6} {:>12} {:>12} {:>12} {:>10}".format(
+        "config", "flavor", "pp (ms)", "frontend (ms)", "verifier (ms)",
+        "RSS (MB)")
+    print(header)
+    print("-" * len(header))
+    results = []
+    for cfg, plugin_args in configs:
+        name = " ".join([cfg.name] + plugin_args)
+        for flavor in flavors:
+            out_dir = os.path.join(args.work_dir, cfg.name, flavor)
+            main_path = gen_tu.generate(cfg, out_dir, flavor)
+            res = measure(args, main_path, flavor, plugin_args)
+            verifier = "-" if res["verifier_ms"] is None \
+                else "{:.2f}".format(res["verifier_ms"])
+            print("{:<48} {:<6} {:>12.2f} {:>12.2f} {:>12} {:>10.1f}".format(
+                name, flavor, res["preprocess_ms"], res["frontend_ms"],
+                verifier, res["peak_rss_mb"]))
+            sys.stdout.flush()
+            res.update({"config": name, "flavor": flavor})
+            results.append(res)
+
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump(results, f, indent=2)
+
+
+if __name__ == "__main__":
+    main()
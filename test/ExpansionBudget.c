@@ -0,0 +1,23 @@
+// RUN: %clang -fsyntax-only -Xclang -load -Xclang %NacroPlugin \
+// RUN:   -Xclang -plugin-arg-nacro-verifier -Xclang max-expansion-tokens=25 \
+// RUN:   -Xclang -verify=expansion %s
+// RUN: %clang -fsyntax-only -Xclang -load -Xclang %NacroPlugin \
+// RUN:   -Xclang -plugin-arg-nacro-verifier -Xclang max-tu-expansion-tokens=45 \
+// RUN:   -Xclang -verify=tu %s
+
+#pragma nacro rule callAll
+(list:$expr*) -> {
+  $loop(i in list) {
+    bar(i);
+  }
+}
+
+void bar(int);
+
+void foo() {
+  // Every element produces 7 tokens (its loop body is wrapped
+  // in braces), plus the enclosing braces
+  callAll(1, 2)
+  callAll(1, 2, 3)
+  callAll(1, 2, 3, 4, 5) // expansion-error {{expanding nacro rule 'callAll' exceeds the limit of 25 tokens}} tu-error {{expanding nacro rule 'callAll' exceeds the limit of 45 tokens per translation unit}}
+}
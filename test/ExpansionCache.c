@@ -0,0 +1,34 @@
+// RUN: %clang -o %t -Xclang -load -Xclang %NacroPlugin %s
+// RUN: %t | %FileCheck %s
+// RUN: %clang -fsyntax-only -Xclang -load -Xclang %NacroPlugin \
+// RUN:   -Xclang -print-stats %s 2>&1 | %FileCheck --check-prefix=STATS %s
+#include <stdio.h>
+
+#pragma nacro rule show
+(base:$expr, items:$expr*) -> {
+  $loop(i in items) {
+    printf("%s: %s = %d\n", $str(base), $str(i), base + i);
+  }
+}
+
+#define ONE 1
+
+int main() {
+  int x = 10, y = 20;
+  show(x, 1, 2)
+  // CHECK: x: 1 = 11
+  // CHECK-NEXT: x: 2 = 12
+  show(x, 1, 2)
+  // CHECK-NEXT: x: 1 = 11
+  // CHECK-NEXT: x: 2 = 12
+  show(y, 1, 2)
+  // CHECK-NEXT: y: 1 = 21
+  // CHECK-NEXT: y: 2 = 22
+  show(x, ONE, 2)
+  // CHECK-NEXT: x: 1 = 11
+  // CHECK-NEXT: x: 2 = 12
+  return 0;
+}
+// STATS: *** Nacro Stats:
+// STATS: Loop expansion cache: 1 hits, 2 misses
+// STATS: Stringification: {{[0-9]+}} unique literals, {{[0-9]+}} reused
@@ -0,0 +1,49 @@
+// RUN: %clang -O1 -emit-llvm -S -Xclang -load -Xclang %NacroPlugin \
+// RUN:   -Xclang -plugin-arg-nacro-verifier -Xclang hygiene %s -o - | %FileCheck %s
+// RUN: %clang -fsyntax-only -Xclang -load -Xclang %NacroPlugin \
+// RUN:   -Xclang -plugin-arg-nacro-verifier -Xclang hygiene -Xclang -verify %s
+// expected-no-diagnostics
+
+#pragma nacro rule foo
+(a:$expr) -> {
+  int x = 0;
+  return a + x;
+}
+
+// The `x` in rule doesn't capture the argument
+// CHECK-LABEL: @foo_caller
+// CHECK: ret i32 %x
+int foo_caller(int x) {
+  foo(x)
+}
+
+#pragma nacro rule square
+(a:$expr) -> $stmt {
+  int t = a, *p = &t;
+  sum += t * *p
+}
+
+// Every expansion has its own declarations
+// CHECK-LABEL: @square_caller
+// CHECK: ret i32 13
+int square_caller() {
+  int sum = 0, t = 3;
+  square(t)
+  square(2)
+  return sum;
+}
+
+#pragma nacro rule pair_sum
+(a:$expr, b:$expr) -> {
+  struct pair { int x, y; } p;
+  p.x = a;
+  p.y = b;
+  return p.x + p.y;
+}
+
+// Only the variable is renamed, not the members
+// CHECK-LABEL: @pair_caller
+// CHECK: ret i32 7
+int pair_caller() {
+  pair_sum(3, 4)
+}
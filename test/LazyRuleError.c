@@ -0,0 +1,21 @@
+// RUN: %clang -fsyntax-only -Xclang -load -Xclang %NacroPlugin \
+// RUN:        -Xclang -plugin-arg-nacro-verifier -Xclang lazy-rules \
+// RUN:        -Xclang -verify %s
+
+int broken(int);
+void bar(int);
+
+// It's not parsed until the first invocation
+#pragma nacro rule broken
+(list:$expr*) -> {
+  $loop(i list) { // expected-error {{expected keyword 'in'}}
+    bar(i);
+  }
+}
+
+void foo() {
+  broken(1)
+  // The rule is retired, so this is a normal function call
+  // rather than an empty expansion
+  int x = broken(2);
+}
@@ -0,0 +1,39 @@
+// RUN: %clang -O1 -emit-llvm -S -Xclang -load -Xclang %NacroPlugin \
+// RUN:        -Xclang -plugin-arg-nacro-verifier -Xclang lazy-rules \
+// RUN:        %s -o - | %FileCheck %s
+// RUN: %clang -fsyntax-only -Xclang -load -Xclang %NacroPlugin \
+// RUN:        -Xclang -plugin-arg-nacro-verifier -Xclang lazy-rules \
+// RUN:        -Xclang -print-stats %s 2>&1 | %FileCheck %s --check-prefix=STATS
+
+#pragma nacro rule addOne
+(a:$expr) -> $expr {
+  a + 1
+}
+
+#pragma nacro rule unused
+(a:$expr) -> {
+  if(a) { bar(a); }
+}
+
+#pragma nacro rule callAll
+(list:$expr*) -> {
+  $loop(i in list) {
+    bar(addOne(i));
+  }
+}
+
+void bar(int i);
+
+void foo() {
+  // CHECK: call void @bar(i32 2)
+  // CHECK: call void @bar(i32 3)
+  // CHECK-NOT: call void @bar
+  callAll(1, 2)
+}
+
+int baz() {
+  // CHECK: ret i32 42
+  return addOne(41);
+}
+// STATS: *** Nacro Stats:
+// STATS: Lazy rules: 2 materialized, 1 never invoked.
@@ -0,0 +1,24 @@
+// RUN: %clang -O1 -emit-llvm -S -Xclang -load -Xclang %NacroPlugin %s -o - | %FileCheck %s
+
+#pragma nacro rule callAll
+(list:$expr*) -> {
+  $loop(i in list) {
+    bar(i);
+  }
+}
+
+void bar(int i);
+#define THREE 3
+#define TWICE(x) ((x) * 2)
+
+void foo() {
+  // Arguments without any macro are used without pre-expansion
+  // CHECK: call void @bar(i32 1)
+  // CHECK: call void @bar(i32 2)
+  callAll(1, 2)
+  // While the others are still pre-expanded
+  // CHECK: call void @bar(i32 3)
+  // CHECK: call void @bar(i32 8)
+  // CHECK-NOT: call void @bar
+  callAll(THREE, TWICE(4))
+}
@@ -0,0 +1,19 @@
+// RUN: %clang -O1 -emit-llvm -S -Xclang -load -Xclang %NacroPlugin %s -o - | %FileCheck %s
+
+#pragma nacro rule callAll
+(list:$expr*) -> {
+  $loop(i in list) {
+    bar(i);
+  }
+}
+
+void bar(int i);
+int add(int a, int b) { return a + b; }
+
+void foo() {
+  // Commas inside parentheses don't split elements
+  // CHECK: call void @bar(i32 3)
+  // CHECK: call void @bar(i32 4)
+  // CHECK-NOT: call void @bar
+  callAll(add(1, 2), 4)
+}
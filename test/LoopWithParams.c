@@ -0,0 +1,22 @@
+// RUN: %clang -o %t -Xclang -load -Xclang %NacroPlugin %s
+// RUN: %t | %FileCheck %s
+#include <stdio.h>
+
+#pragma nacro rule show
+(base:$expr, items:$expr*) -> {
+  $loop(i in items) {
+    printf("%s + %s = %d\n", $str(base), $str(i), base + i);
+  }
+}
+
+int main() {
+  int x = 10;
+  show(x, 1, 2)
+  // CHECK: x + 1 = 11
+  // CHECK-NEXT: x + 2 = 12
+  show(x * 2, 3)
+  // CHECK-NEXT: x * 2 + 3 = 23
+  show(x, 4)
+  // CHECK-NEXT: x + 4 = 14
+  return 0;
+}
@@ -0,0 +1,31 @@
+// RUN: %clang -O1 -emit-llvm -S -Xclang -load -Xclang %NacroPlugin %s -o - | %FileCheck %s
+
+#pragma nacro rule callFoo
+(list:$expr*) -> {
+  $loop(i in list) {
+    foo(i);
+  }
+}
+
+#define TWICE(x) ((x) * 2)
+
+#pragma nacro rule callBar
+(list:$expr*) -> {
+  $loop(i in list) {
+    bar(i);
+  }
+}
+
+void foo(int i);
+void bar(int i);
+
+void caller() {
+  // CHECK: call void @bar(i32 1)
+  // CHECK: call void @bar(i32 2)
+  callBar(1, 2)
+  // CHECK: call void @foo(i32 6)
+  // CHECK: call void @foo(i32 4)
+  callFoo(TWICE(3), 4)
+  // CHECK: call void @bar(i32 5)
+  callBar(5)
+}
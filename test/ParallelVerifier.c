@@ -0,0 +1,33 @@
+// RUN: %clang -fsyntax-only -Xclang -load -Xclang %NacroPlugin \
+// RUN:   -Xclang -plugin-arg-nacro-verifier -Xclang verifier-threads=4 \
+// RUN:   -Xclang -verify %s
+
+#pragma nacro rule foo
+(a:$expr) -> {
+  int x = 0; // expected-note 4 {{is bind to declaration within a nacro}}
+  return a + x;
+}
+
+int caller1(int x) {
+  foo(x) // expected-error{{a potential declaration leak detected}} expected-note{{the reference to 'x' that comes from outside a nacro}}
+}
+
+int caller2(int y) {
+  foo(y)
+}
+
+int caller3(int x) {
+  foo(x + 1) // expected-error{{a potential declaration leak detected}} expected-note{{the reference to 'x' that comes from outside a nacro}}
+}
+
+int unrelated(int x) {
+  return x;
+}
+
+int caller4(int y) {
+  foo(y * 2)
+}
+
+int caller5(int x) {
+  foo(x * x) // expected-error 2 {{a potential declaration leak detected}} expected-note 2 {{the reference to 'x' that comes from outside a nacro}}
+}
@@ -0,0 +1,25 @@
+// RUN: %clang -E -Xclang -load -Xclang %NacroPlugin \
+// RUN:   -mllvm -nacro-option=hygiene %s | %FileCheck %s
+// RUN: %clang -E -Xclang -load -Xclang %NacroPlugin \
+// RUN:   -mllvm -nacro-option=max-expansion-tokens=20 \
+// RUN:   -Xclang -verify %s -o /dev/null
+
+// Plugin arguments never reach nacro when clang only preprocesses,
+// options given by -mllvm are honored in every mode.
+#pragma nacro rule foo
+(a:$expr*) -> {
+  $loop(i in a) {
+    int x = i;
+  }
+}
+
+// CHECK-LABEL: void caller
+// CHECK: int nacro_x_{{[0-9]+}} = 1;
+// CHECK: int nacro_x_{{[0-9]+}} = 2;
+void caller() {
+  foo(1, 2)
+}
+
+void too_long() {
+  foo(1, 2, 3) // expected-error {{expanding nacro rule 'foo' exceeds the limit of 20 tokens}}
+}
@@ -0,0 +1,20 @@
+// RUN: %clang -O1 -emit-llvm -S -Xclang -load -Xclang %NacroPlugin %s -o - | %FileCheck %s --check-prefix=DEFAULT
+// RUN: %clang -O1 -emit-llvm -S -Xclang -load -Xclang %NacroPlugin \
+// RUN:        -Xclang -plugin-arg-nacro-verifier -Xclang raw-lexing \
+// RUN:        %s -o - | %FileCheck %s --check-prefix=RAW
+
+#define VAL 1
+
+#pragma nacro rule getVal
+(a:$expr) -> $expr {
+  a + VAL
+}
+
+#undef VAL
+#define VAL 2
+
+// DEFAULT: ret i32 1
+// RAW: ret i32 2
+int foo() {
+  return getVal(0);
+}
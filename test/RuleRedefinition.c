@@ -0,0 +1,45 @@
+// RUN: %clang -fsyntax-only -Xclang -load -Xclang %NacroPlugin -Xclang -verify %s
+// RUN: %clang -fsyntax-only -Xclang -load -Xclang %NacroPlugin \
+// RUN:   -Xclang -print-stats %s 2>&1 | %FileCheck --check-prefix=STATS %s
+// RUN: %clang -fsyntax-only -Xclang -load -Xclang %NacroPlugin \
+// RUN:   -Xclang -plugin-arg-nacro-verifier -Xclang lazy-rules \
+// RUN:   -Xclang -print-stats %s 2>&1 | %FileCheck --check-prefix=STATS %s
+
+// e.g. A header without include guards
+#pragma nacro rule twice
+(a:$expr) -> $expr {
+  a * 2
+}
+
+#pragma nacro rule twice
+(a:$expr) -> $expr {
+  a * 2
+}
+
+#pragma nacro rule callAll
+(list:$expr*) -> {
+  $loop(i in list) { bar(i); }
+}
+
+#pragma nacro rule callAll
+(list:$expr*) -> {
+  $loop(i in list) { bar(i); }
+}
+
+#pragma nacro rule triple
+(a:$expr) -> $expr { // expected-note {{previous definition is here}}
+  a * 3
+}
+
+#pragma nacro rule triple
+(a:$expr) -> $expr { // expected-warning {{nacro rule 'triple' is redefined with a different body}}
+  a + a + a + 0
+}
+
+void bar(int);
+
+int foo(int x) {
+  callAll(twice(x), triple(x))
+  return twice(x);
+}
+// STATS: Rule redefinitions: 2 duplicated, 1 conflicting.
@@ -0,0 +1,54 @@
+// RUN: %clang -O1 -emit-llvm -S -Xclang -load -Xclang %NacroPlugin %s -o - | %FileCheck %s
+// RUN: %clang -fsyntax-only -Xclang -load -Xclang %NacroPlugin \
+// RUN:   -Xclang -print-stats %s 2>&1 | %FileCheck --check-prefix=STATS %s
+
+#pragma nacro rule tmp
+(a:$expr) -> $expr {
+  a + 1
+}
+
+// CHECK-LABEL: @f1
+// CHECK: ret i32 2
+int f1() { return tmp(1); }
+
+#pragma nacro undef tmp
+#ifdef tmp
+#error "tmp should be undefined"
+#endif
+
+#pragma nacro rule outer
+(a:$expr) -> $expr {
+  a * 10
+}
+
+#pragma nacro push outer
+#pragma nacro undef outer
+#pragma nacro rule outer
+(list:$expr*) -> {
+  $loop(i in list) {
+    bar(i);
+  }
+}
+
+void bar(int);
+// CHECK-LABEL: @f2
+// CHECK: call void @bar(i32 1)
+// CHECK: call void @bar(i32 2)
+void f2() { outer(1, 2) }
+#pragma nacro pop outer
+
+// CHECK-LABEL: @f3
+// CHECK: ret i32 40
+int f3() { return outer(4); }
+
+#pragma nacro push gen
+#pragma nacro rule gen
+(a:$expr) -> $expr {
+  a
+}
+#pragma nacro pop gen
+#ifdef gen
+#error "gen should be undefined"
+#endif
+
+// STATS: Rule redefinitions: 0 duplicated, 0 conflicting, 4 retired.
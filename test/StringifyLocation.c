@@ -0,0 +1,30 @@
+// RUN: %clang -fsyntax-only -Xclang -load -Xclang %NacroPlugin \
+// RUN:   -Xclang -verify %s
+
+// Both rules stringify the same argument, so the second one reuses
+// the literal created by the first one. Diagnostics must still point
+// at the invocation expanding it, rather than the rule body or the
+// invocation that created the literal.
+#pragma nacro rule first
+(a:$expr*) -> {
+  $loop(i in a) {
+    int first_n = $str(i);
+  }
+}
+
+#pragma nacro rule second
+(a:$expr*) -> {
+  $loop(i in a) {
+    int second_n = $str(i);
+  }
+}
+
+void foo() {
+  first(x) // expected-warning {{incompatible pointer to integer conversion}}
+  second(x) // expected-warning {{incompatible pointer to integer conversion}}
+}
+
+void bar() {
+  // Reuse the cached expansion
+  first(x) // expected-warning {{incompatible pointer to integer conversion}}
+}
@@ -0,0 +1,27 @@
+// RUN: %clang -c -Xclang -load -Xclang %NacroPlugin \
+// RUN:   -ftime-trace -ftime-trace-granularity=0 %s -o %t.o
+// RUN: %FileCheck %s < %t.json
+
+// CHECK-DAG: "name":"NacroParseRule","args":{"detail":"twice"}
+// CHECK-DAG: "name":"NacroProtectRule","args":{"detail":"twice"}
+// CHECK-DAG: "name":"NacroParseRule","args":{"detail":"each"}
+// CHECK-DAG: "name":"NacroExpandLoop","args":{"detail":"each"}
+// CHECK-DAG: "name":"NacroVerifyDecl","args":{"detail":"caller"}
+
+void sink(int);
+
+#pragma nacro rule twice
+(a:$expr) -> $expr {
+  a * 2
+}
+
+#pragma nacro rule each
+(xs:$expr*) -> {
+  $loop(x in xs) {
+    sink(x);
+  }
+}
+
+void caller(int v) {
+  each(twice(v), v, 3)
+}
@@ -0,0 +1,27 @@
+// RUN: rm -f %t.jsonl
+// RUN: %clang -fsyntax-only -Xclang -load -Xclang %NacroPlugin \
+// RUN:   -Xclang -plugin-arg-nacro-verifier -Xclang trace-file=%t.jsonl %s
+// RUN: %FileCheck %s < %t.jsonl
+
+void sink(int);
+
+#pragma nacro rule twice
+(a:$expr) -> $expr {
+  a * 2
+}
+
+#pragma nacro rule each
+(xs:$expr*) -> {
+  $loop(x in xs) {
+    sink(x);
+  }
+}
+
+// Arguments are pre-expanded while the loop expands, so the
+// order of these records is not guaranteed
+void caller(int v) {
+// CHECK-DAG: {"tu":"{{.*}}TraceFile.c","rule":"twice","loc":"{{.*}}TraceFile.c:[[@LINE+3]]:8","loop":false,"va_elements":0,"input_tokens":1,"output_tokens":{{[0-9]+}},"time_us":{{.*}}}
+// CHECK-DAG: {"tu":"{{.*}}TraceFile.c","rule":"each","loc":"{{.*}}TraceFile.c:[[@LINE+2]]:3","loop":true,"va_elements":3,"input_tokens":8,"output_tokens":{{[0-9]+}},"time_us":{{.*}}}
+// CHECK-NOT: "rule"
+  each(twice(v), v, 3)
+}
@@ -0,0 +1,17 @@
+// RUN: %clang -fsyntax-only -Xclang -load -Xclang %NacroPlugin \
+// RUN:   -Xclang -verify %s
+// expected-no-diagnostics
+
+#pragma nacro rule color_values
+(base:$expr) -> {
+  Red = base, Green, Blue
+}
+
+enum Color color_values(1);
+
+// Declarations created by a file-scope invocation can be used
+// by other declarations. Only the declaration containing the
+// invocation is verified.
+int is_red(enum Color c) {
+  return c == Red;
+}
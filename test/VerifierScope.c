@@ -0,0 +1,29 @@
+// RUN: %clang -fsyntax-only -Xclang -load -Xclang %NacroPlugin \
+// RUN:   -DLEAK -Xclang -verify %s
+// RUN: %clang -fsyntax-only -Xclang -load -Xclang %NacroPlugin \
+// RUN:   -Xclang -print-stats %s 2>&1 | %FileCheck %s
+
+#pragma nacro rule foo
+(a:$expr) -> {
+  int x = 0; // expected-note {{is bind to declaration within a nacro}}
+  return a + x;
+}
+
+int global;
+
+int unrelated(int x) {
+  return x + global;
+}
+
+// Only the declaration invoking a rule is verified
+// CHECK: Verifier cache: 0 declaration hits, 2 misses;
+// CHECK: Verifier: 1 of {{[0-9]+}} top-level declarations visited.
+#ifdef LEAK
+int foo_caller(int x) {
+  foo(x) // expected-error{{a potential declaration leak detected}} expected-note{{the reference to 'x' that comes from outside a nacro}}
+}
+#else
+int foo_caller(int y) {
+  foo(y)
+}
+#endif
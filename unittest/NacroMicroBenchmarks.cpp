@@ -0,0 +1,140 @@
+#include "llvm/ADT/StringExtras.h"
+#include "NacroContext.h"
+#include "NacroExpanders.h"
+#include "NacroParsers.h"
+#include "LexingEnv.h"
+#include "benchmark/benchmark.h"
+#include <memory>
+#include <string>
+
+using namespace clang;
+
+namespace {
+/// `(a0:$expr, a1:$expr, ...) -> { sink(a0 + a1 ...); ... }`
+/// with \p BodySize statements
+std::string GenRuleSource(unsigned BodySize, unsigned NumArgs) {
+  std::string Params, Sum;
+  for(unsigned I = 0; I < NumArgs; ++I) {
+    auto Name = "a" + llvm::utostr(I);
+    Params += (I? ", " : "") + Name + ":$expr";
+    Sum += (I? " + " : "") + Name;
+  }
+  std::string Source = "(" + Params + ") -> {";
+  for(unsigned I = 0; I < BodySize; ++I)
+    Source += " sink(" + Sum + ");";
+  return Source + " }";
+}
+
+/// A looped rule named `gen` with \p BodySize statements
+/// in its loop, followed by an invocation of \p ListLength elements
+std::string GenLoopSource(unsigned BodySize, unsigned ListLength) {
+  std::string Source = "gen (xs:$expr*) -> { $loop(x in xs) {";
+  for(unsigned I = 0; I < BodySize; ++I)
+    Source += " sink(x * " + llvm::utostr(I) + ");";
+  Source += " } }\ngen(";
+  for(unsigned I = 0; I < ListLength; ++I)
+    Source += (I? ", " : "") + llvm::utostr(I);
+  return Source + ")";
+}
+
+/// Everything needed to run nacro on a single buffer.
+/// It's recreated (with timer paused) on every iteration, since a
+/// SourceManager can't be reset and its offset space would
+/// eventually run out.
+struct NacroBenchEnv {
+  NacroLexingEnv Env;
+  TrivialModuleLoader ModLoader;
+  std::unique_ptr<Preprocessor> PP;
+
+  explicit NacroBenchEnv(llvm::StringRef Source)
+    : PP(Env.CreatePP(Source, ModLoader)) {}
+};
+} // end anonymous namespace
+
+static void BM_ParseRule(benchmark::State& State) {
+  auto Source = GenRuleSource(State.range(0), State.range(1));
+  std::unique_ptr<NacroBenchEnv> BE;
+  for(auto _ : State) {
+    State.PauseTiming();
+    BE.reset(new NacroBenchEnv(Source));
+    auto& Ctx = NacroContext::Get(*BE->PP);
+    State.ResumeTiming();
+
+    NacroRuleParser Parser(Ctx, {});
+    benchmark::DoNotOptimize(Parser.Parse());
+  }
+}
+BENCHMARK(BM_ParseRule)
+  ->RangeMultiplier(4)
+  ->Ranges({{1, 256}, {1, 16}})
+  ->Unit(benchmark::kMicrosecond);
+
+static void BM_ReplacementProtecting(benchmark::State& State) {
+  auto Source = GenRuleSource(State.range(0), State.range(1));
+  std::unique_ptr<NacroBenchEnv> BE;
+  for(auto _ : State) {
+    State.PauseTiming();
+    BE.reset(new NacroBenchEnv(Source));
+    NacroRuleParser Parser(*BE->PP, {});
+    Parser.Parse();
+    NacroRuleExpander Expander(Parser.getNacroRule(), *BE->PP);
+    State.ResumeTiming();
+
+    auto E = Expander.ReplacementProtecting();
+    benchmark::DoNotOptimize(bool(E));
+    llvm::consumeError(std::move(E));
+  }
+}
+BENCHMARK(BM_ReplacementProtecting)
+  ->RangeMultiplier(4)
+  ->Ranges({{1, 256}, {1, 16}})
+  ->Unit(benchmark::kMicrosecond);
+
+static void BM_LoopExpansion(benchmark::State& State) {
+  auto Source = GenLoopSource(State.range(0), State.range(1));
+  std::unique_ptr<NacroBenchEnv> BE;
+  size_t NumTokens = 0;
+  for(auto _ : State) {
+    State.PauseTiming();
+    BE.reset(new NacroBenchEnv(Source));
+    Token Tok;
+    BE->PP->Lex(Tok);
+    NacroRuleParser Parser(*BE->PP, {Tok});
+    Parser.Parse();
+    auto* Rule = Parser.getNacroRule();
+    NacroRuleExpander Expander(Rule, *BE->PP);
+    llvm::consumeError(Expander.Expand());
+    // Export the rule like NacroPragmaHandler does, otherwise
+    // its invocation won't be dispatched to the loop expander
+    NacroContext::Get(*BE->PP)
+      .AddDefinedRule(Rule->getName(), Parser.getFingerprint(),
+                      Rule->getBeginLoc(), Rule);
+    State.ResumeTiming();
+
+    // Lexing the invocation triggers the expansion
+    do {
+      BE->PP->Lex(Tok);
+      ++NumTokens;
+    } while(Tok.isNot(tok::eof));
+  }
+
+  // Every iteration lexes at least the trailing eof
+  if(NumTokens <= size_t(State.iterations()))
+    State.SkipWithError("The invocation was not expanded");
+  State.counters["tokens"] = benchmark::Counter(
+    NumTokens, benchmark::Counter::kAvgIterations);
+  State.SetComplexityN(State.range(1));
+}
+BENCHMARK(BM_LoopExpansion)
+  ->RangeMultiplier(4)
+  ->Ranges({{1, 64}, {1, 256}})
+  ->Unit(benchmark::kMicrosecond);
+// Expansion time should grow linearly with the list length
+BENCHMARK(BM_LoopExpansion)
+  ->Args({1, 1000})
+  ->Args({1, 10000})
+  ->Args({1, 100000})
+  ->Complexity(benchmark::oN)
+  ->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,116 @@
+#include "llvm/ADT/STLExtras.h"
+#include "NacroContext.h"
+#include "NacroExpanders.h"
+#include "NacroParsers.h"
+#include "LexingTestFixture.h"
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace clang;
+
+namespace {
+struct ExpansionResult {
+  unsigned NumCalls = 0,
+           NumStrings = 0,
+           NumForeignCalls = 0;
+  bool SameContext = false;
+};
+
+/// A translation unit that defines a looped rule whose body
+/// is unique to its ID and expands it with three elements
+class NacroTranslationUnit {
+  NacroLexingEnv Env;
+  TrivialModuleLoader ModLoader;
+  std::unique_ptr<Preprocessor> PP;
+  std::string Callee;
+
+public:
+  explicit NacroTranslationUnit(unsigned ID)
+    : Callee("f" + std::to_string(ID)) {
+    std::string Source = "gen (xs:$expr*) -> {"
+                         "  $loop(x in xs) { " + Callee + "(x, $str(x)); }"
+                         "}\n"
+                         "gen(1, 2, 3)";
+    PP = Env.CreatePP(Source, ModLoader);
+  }
+
+  ExpansionResult Run() {
+    ExpansionResult Result;
+    Token Tok;
+    PP->Lex(Tok);
+    NacroRuleParser Parser(*PP, {Tok});
+    if(!Parser.Parse()) return Result;
+    auto* Rule = Parser.getNacroRule();
+    NacroRuleExpander Expander(Rule, *PP);
+    if(auto E = Expander.Expand()) {
+      llvm::consumeError(std::move(E));
+      return Result;
+    }
+
+    // Export the rule like NacroPragmaHandler does, otherwise
+    // its invocations won't be dispatched to the loop expander
+    auto& Ctx = NacroContext::Get(*PP);
+    Ctx.AddDefinedRule(Rule->getName(), Parser.getFingerprint(),
+                       Rule->getBeginLoc(), Rule);
+    Result.SameContext = &Ctx == &NacroContext::Get(*PP) &&
+                         &Ctx.getPreprocessor() == PP.get();
+    while(true) {
+      PP->Lex(Tok);
+      if(Tok.is(tok::eof)) break;
+      if(Tok.is(tok::string_literal)) {
+        ++Result.NumStrings;
+      } else if(Tok.is(tok::identifier)) {
+        auto Name = Tok.getIdentifierInfo()->getName();
+        if(Name == Callee)
+          ++Result.NumCalls;
+        else if(Name.startswith("f"))
+          ++Result.NumForeignCalls;
+      }
+    }
+    return Result;
+  }
+};
+
+void CheckResult(const ExpansionResult& Result) {
+  ASSERT_TRUE(Result.SameContext);
+  ASSERT_EQ(Result.NumCalls, 3);
+  ASSERT_EQ(Result.NumStrings, 3);
+  // Nothing leaks from rules in other translation units
+  ASSERT_EQ(Result.NumForeignCalls, 0);
+}
+} // end anonymous namespace
+
+TEST(NacroContextTest, TestConcurrentTranslationUnits) {
+  constexpr unsigned NumThreads = 8, NumTUsPerThread = 16;
+  std::vector<ExpansionResult> Results(NumThreads * NumTUsPerThread);
+
+  std::vector<std::thread> Workers;
+  for(unsigned T = 0; T < NumThreads; ++T) {
+    Workers.emplace_back([&Results, T] {
+      for(unsigned I = 0; I < NumTUsPerThread; ++I) {
+        unsigned ID = T * NumTUsPerThread + I;
+        Results[ID] = NacroTranslationUnit(ID).Run();
+      }
+    });
+  }
+  for(auto& Worker : Workers)
+    Worker.join();
+
+  for(const auto& Result : Results)
+    CheckResult(Result);
+}
+
+TEST(NacroContextTest, TestCrossThreadTeardown) {
+  auto TU = std::make_unique<NacroTranslationUnit>(0);
+  CheckResult(TU->Run());
+  // Destroy the Preprocessor on another thread than the one
+  // that created its context
+  std::thread([&TU] { TU.reset(); }).join();
+
+  // New Preprocessors are likely to reuse the address of the
+  // old one, and must not pick up its context
+  for(unsigned ID = 1; ID < 16; ++ID)
+    CheckResult(NacroTranslationUnit(ID).Run());
+}
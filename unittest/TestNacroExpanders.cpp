@@ -2,6 +2,7 @@
 #include "NacroExpanders.h"
 #include "LexingTestFixture.h"
 #include <memory>
+#include <string>
 #include <utility>
 
 using namespace clang;
@@ -36,6 +37,29 @@ TEST_F(NacroExpanderTest, TestRuleReplacementExprProtecting) {
   ASSERT_EQ(Expander.getNacroRule()->token_size(), PrevTokenSize + 4);
 }
 
+TEST_F(NacroExpanderTest, TestRuleReplacementProtectingLargeBody) {
+  constexpr unsigned NumRefs = 5000;
+  std::string Source = "(a:$expr, b:$stmt)-> { foo(a";
+  for(unsigned I = 1; I < NumRefs; ++I)
+    Source += " + a";
+  Source += "); b }";
+  auto RE = GetRuleEssential(Source);
+  auto& Rule = *RE.first;
+  auto& PP = *RE.second;
+
+  auto PrevTokenSize = Rule.token_size();
+  NacroRuleExpander Expander(&Rule, PP);
+  auto E = Expander.ReplacementProtecting();
+  ASSERT_FALSE(E);
+
+  // A pair of parens for each 'a' and a semicolon for 'b'
+  ASSERT_EQ(Rule.token_size(), PrevTokenSize + NumRefs * 2 + 1);
+  // '... b ; }'
+  auto NumTokens = Rule.token_size();
+  ASSERT_TRUE(Rule.getToken(NumTokens - 2).is(tok::semi));
+  ASSERT_TRUE(Rule.getToken(NumTokens - 3).is(tok::identifier));
+}
+
 TEST_F(NacroExpanderTest, TestRuleReplacementStringifyNoProtect) {
   // Don't protect $expr replacement if it's gonna be stringified
   auto RE = GetRuleEssential("(a:$expr, b:$expr)-> {puts($str(a)); puts(b);}");
@@ -64,3 +88,34 @@ TEST_F(NacroExpanderTest, TestRuleReplacementStringifyNoProtect) {
   ASSERT_TRUE(Rule.getToken(IdxB - 1).is(tok::l_paren));
   ASSERT_TRUE(Rule.getToken(IdxB + 1).is(tok::r_paren));
 }
+
+TEST_F(NacroExpanderTest, TestRuleLoopTemplate) {
+  auto RE = GetRuleEssential("(a:$expr, b:$expr*)-> {"
+                             "  $loop(i in b) { foo(a, $str(i), i); }"
+                             "}");
+  auto& Rule = *RE.first;
+  Rule.BuildTemplate();
+
+  using SlotTy = NacroRule::TemplateSlot;
+  std::vector<SlotTy::SlotKind> Kinds;
+  for(const auto& Slot : Rule.getTemplate())
+    Kinds.push_back(Slot.Kind);
+  std::vector<SlotTy::SlotKind> Expected {
+    SlotTy::Literal, // '{'
+    SlotTy::Loop,
+    SlotTy::Literal, // '{ foo ('
+    SlotTy::Param,
+    SlotTy::Literal, // ','
+    SlotTy::StrLoopVar,
+    SlotTy::Literal, // ','
+    SlotTy::LoopVar,
+    SlotTy::Literal, // ') ; }'
+    SlotTy::Literal  // '}'
+  };
+  ASSERT_EQ(Kinds, Expected);
+
+  // Loop body ends right before the last slot
+  auto& LoopSlot = Rule.getTemplate()[1];
+  ASSERT_EQ(LoopSlot.Begin, 0);
+  ASSERT_EQ(LoopSlot.End, Expected.size() - 1);
+}
@@ -1,4 +1,5 @@
 #include "llvm/ADT/STLExtras.h"
+#include "NacroContext.h"
 #include "NacroParsers.h"
 #include "LexingTestFixture.h"
 
@@ -143,3 +144,52 @@ TEST_F(NacroParserTest, TestRuleStringify) {
   }
   ASSERT_LT(I, E);
 }
+
+TEST_F(NacroParserTest, TestRuleRawLexing) {
+  auto PP = GetPP("#define one 1\n"
+                  "; (a:$expr) -> $expr { one + a }\n"
+                  "int");
+  // Consume the macro definition
+  Token Tok;
+  PP->Lex(Tok);
+  ASSERT_TRUE(Tok.is(tok::semi));
+
+  NacroRuleParser Parser(*PP, {});
+  ASSERT_TRUE(Parser.UseRawLexer());
+  ASSERT_TRUE(Parser.Parse());
+
+  // Macros are not expanded within the rule
+  auto& Rule = *Parser.getNacroRule();
+  ASSERT_TRUE(llvm::any_of(Rule.tokens(),
+                           [](Token Tok) {
+                             return Tok.is(tok::identifier) &&
+                                    Tok.getIdentifierInfo()->isStr("one");
+                           }));
+  ASSERT_TRUE(llvm::none_of(Rule.tokens(),
+                            [](Token Tok) {
+                              return Tok.is(tok::numeric_constant);
+                            }));
+
+  // Preprocessor resumes right after the rule
+  PP->Lex(Tok);
+  ASSERT_TRUE(Tok.is(tok::kw_int));
+}
+
+TEST_F(NacroParserTest, TestRuleRecycling) {
+  auto PP = GetPP("(a:$expr) -> $expr { a + 1 }");
+  auto& Ctx = NacroContext::Get(*PP);
+  NacroRule* Rule;
+  {
+    NacroRuleParser Parser(*PP, {});
+    ASSERT_TRUE(Parser.Parse());
+    Rule = Parser.getNacroRule();
+    ASSERT_EQ(Rule->replacements_size(), 1);
+  }
+
+  // Storage of a destroyed rule is reused by the next one
+  Ctx.DestroyRule(Rule);
+  auto* NewRule = Ctx.CreateRule(nullptr);
+  ASSERT_EQ(NewRule, Rule);
+  ASSERT_EQ(NewRule->replacements_size(), 0);
+  ASSERT_EQ(NewRule->token_size(), 0);
+}
@@ -0,0 +1,47 @@
+#include "NacroContext.h"
+#include "NacroVerifier.h"
+#include "LexingTestFixture.h"
+
+using namespace clang;
+
+class NacroVerifierTest : public NacroLexingTest {
+protected:
+  NacroVerifierTest() = default;
+
+  SourceLocation getLoc(unsigned Offset) {
+    return SourceMgr.getLocForStartOfFile(SourceMgr.getMainFileID())
+                    .getLocWithOffset(Offset);
+  }
+};
+
+TEST_F(NacroVerifierTest, TestRuleDepotLookup) {
+  TrivialModuleLoader ModLoader;
+  auto PP = CreatePP("0123456789abcdefghij", ModLoader);
+  auto& Ctx = NacroContext::Get(*PP);
+  auto* R1 = Ctx.CreateRule(nullptr);
+  auto* R2 = Ctx.CreateRule(nullptr);
+
+  NacroRuleDepot Depot;
+  ASSERT_FALSE(Depot);
+  // Inserted out of order
+  Depot.insert(getLoc(10), getLoc(15), R2, SourceMgr);
+  Depot.insert(getLoc(2), getLoc(5), R1, SourceMgr);
+  ASSERT_TRUE(Depot);
+
+  ASSERT_EQ(Depot.lookup(getLoc(0), SourceMgr), nullptr);
+  ASSERT_EQ(Depot.lookup(getLoc(2), SourceMgr), R1);
+  ASSERT_EQ(Depot.lookup(getLoc(4), SourceMgr), R1);
+  // Ranges are half-open
+  ASSERT_EQ(Depot.lookup(getLoc(5), SourceMgr), nullptr);
+  ASSERT_EQ(Depot.lookup(getLoc(12), SourceMgr), R2);
+  ASSERT_EQ(Depot.lookup(getLoc(19), SourceMgr), nullptr);
+  ASSERT_EQ(Depot.lookup(SourceLocation(), SourceMgr), nullptr);
+
+  // Only erase the interval owned by the given rule
+  Depot.erase(getLoc(2), R2, SourceMgr);
+  ASSERT_EQ(Depot.lookup(getLoc(3), SourceMgr), R1);
+  Depot.erase(getLoc(2), R1, SourceMgr);
+  ASSERT_EQ(Depot.lookup(getLoc(3), SourceMgr), nullptr);
+  Depot.erase(getLoc(10), R2, SourceMgr);
+  ASSERT_FALSE(Depot);
+}